@@ -28,86 +28,140 @@
 
 
 #include "../yocto/yocto_gl.h"
+#include "../yocto/ext/json.hpp"
 
 using namespace ygl;
 using namespace std;
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <csignal>
+#include <chrono>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <stack>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+
+//Mixes the bits of v (splitmix64 finalizer), used to derive the seeds of the random streams
+uint64_t mixSeed(uint64_t v) {
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ull;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebull;
+    return v ^ (v >> 31);
+}
 
+//Stream used by the road generator, cells use their coordinates as stream so they never clash with it
+const uint64_t roadsStream = ~0ull;
 
-// Generates random numbers in interval
-// Method took from: [STACK OVERFLOW = https://stackoverflow.com/questions/7560114/random-number-c-in-some-range]
-// Author: Nawaz
-int random(int min, int max) //range : [min, max)
-{
-    static bool first = true;
-    if (first) {
-        srand(time(NULL)); //seeding for the first time only!
-        first = false;
-    }
-    return min + rand() % ((max + 1) - min);
+//Mixed to the seed of the city for the streams of scatterTrees, that are the ones of the first cell of every region
+const uint64_t treesStream = 0x7472656573ull;
+
+//Returns the random generator of the stream of the city generated with seed
+//each stream is an independent pcg32 sequence, so the same seed always gives the same numbers
+rng_pcg32 streamRng(uint64_t seed, uint64_t stream) {
+    return init_rng(mixSeed(seed ^ mixSeed(stream)), stream);
 }
 
-//Rappresents a collection of models of some type
-struct model {
-    //all possible models
-    map<int, vector<string>> possibilities;
+//Returns the random generator of the cell (x,y): every cell has its own stream so that any region
+//of the city can be generated alone, in any order or in parallel, with the same result
+rng_pcg32 cellRng(uint64_t seed, int x, int y) {
+    return streamRng(seed, ((uint64_t) (uint32_t) x << 32) | (uint32_t) y);
+}
 
-    map<int, vec3f> height;
+//Generates random numbers in interval [min, max]
+int random(rng_pcg32 &rng, int min, int max) {
+    return min + (int) next_rand1i(rng, (uint32_t) (max + 1 - min));
+}
 
+//Integer id of a kit model file, its index in the catalog
+typedef int model_id;
 
-    //the height of actual model
+//Categories of the pieces of the kit
+enum piece_category {
+    piece_base, piece_block, piece_curtain, piece_floor, piece_roof, piece_road, piece_crossing, piece_ground,
+    piece_tree, piece_count
+};
 
-    model(int type, string filename, vec3f height) {
-        vector<string> possibile = vector<string>();
-        possibile.push_back(filename);
-        this->possibilities.insert(pair<int, vector<string>>(type, possibile));
-        this->height[type] = height;
-    }
+//Rappresents a collection of models of some type
+struct model {
+    //all possible models for each type
+    vector<vector<model_id>> possibilities;
 
-    //adds another model to the actual collection
-    void addPossibility(int type, string filename) {
-        vector<string> possibile = vector<string>();
-        if (possibilities.find(type) != possibilities.end()) {
-            possibile = possibilities.at(type);
-        } else
-            this->possibilities.insert(pair<int, vector<string>>(type, possibile));
+    //the height of the models of each type
+    vector<vec3f> height;
 
-        if (height.find(type) == height.end()) {
-            height[type] = height[0];
-        }
-        possibile.push_back(filename);
-        possibilities[type] = possibile;
+    //adds another model to the actual collection, a new type takes the height of type 0
+    void addPossibility(int type, model_id id) {
+        if (possibilities.size() <= type) possibilities.resize(type + 1);
+        if (height.size() <= type) height.resize(type + 1, height.empty() ? zero3f : height[0]);
+        possibilities[type].push_back(id);
     }
 
     void setHeight(int type, vec3f height) {
+        if (this->height.size() <= type) this->height.resize(type + 1);
         this->height[type] = height;
     }
 
-
-    vec3f getHeight(int type) {
-        return height[type];
+    vec3f getHeight(int type) const {
+        return type >= 0 && type < height.size() ? height[type] : zero3f;
     }
 
     //Get random model from all possibles of some type
-    string getRandomPossibility(int type) {
-
-        vector<string> possibile = possibilities.at(type == -1 ? 0 : type);
-        //cout << possibile.size() << "\n";
-        return possibile.at(random(0, possibile.size() - 1));
+    model_id getRandomPossibility(rng_pcg32 &rng, int type) const {
+        auto &possibile = possibilities.at(type == -1 ? 0 : type);
+        return possibile.at(random(rng, 0, possibile.size() - 1));
     }
 
     //Get random model from all possibles
-    string getRandomPossibility() {
+    model_id getRandomPossibility(rng_pcg32 &rng) const {
+        return getRandomPossibility(rng, -1);
+    }
+};
+
+//All the models of the kit, resolved once at startup and only read by the generation
+struct model_catalog {
+    //filename of each model id
+    vector<string> filenames;
+    model pieces[piece_count];
+
+    //returns the id of a model file, adding it the first time
+    model_id addFile(const string &filename) {
+        auto found = find(filenames.begin(), filenames.end(), filename);
+        if (found != filenames.end()) return (model_id) (found - filenames.begin());
+        filenames.push_back(filename);
+        return (model_id) filenames.size() - 1;
+    }
 
-        return getRandomPossibility(-1);
+    //adds the first model of a type of a piece
+    model &addModel(piece_category piece, int type, const string &filename, vec3f height) {
+        auto &m = pieces[piece];
+        m.setHeight(type, height);
+        m.addPossibility(type, addFile(filename));
+        return m;
     }
+
+    const model &operator[](piece_category piece) const { return pieces[piece]; }
 };
 
 //loads the models filenames
-map<string, model *> loadModels() {
+model_catalog loadModels() {
     string prefixBuilding = "in/modularBuildings_";
     string prefixRoads = "in/roadTile_";
 
@@ -123,125 +177,1152 @@ map<string, model *> loadModels() {
 
     auto floorHeight = vec3f{0, 0.62f, 0};
 
-    map<string, model *> modelsMap;
+    model_catalog catalog;
+
+    auto &base = catalog.addModel(piece_base, 0, prefixBuilding + "026a" + suffix, baseHeight);
+    base.addPossibility(0, catalog.addFile(prefixBuilding + "025a" + suffix));
+    base.addPossibility(0, catalog.addFile(prefixBuilding + "025b" + suffix));
+    base.addPossibility(1, catalog.addFile(prefixBuilding + "038" + suffix));
+    base.addPossibility(1, catalog.addFile(prefixBuilding + "038a" + suffix));
+    base.addPossibility(1, catalog.addFile(prefixBuilding + "038b" + suffix));
+    base.addPossibility(2, catalog.addFile(prefixBuilding + "022" + suffix));
+
+    base.setHeight(1, floorHeight);
+    base.setHeight(2, floorHeight);
+
+
+    auto &block = catalog.addModel(piece_block, 0, prefixBuilding + "005" + suffix, blockHeight);
+    block.addPossibility(1, catalog.addFile(prefixBuilding + "017" + suffix));
+
+
+    auto &curtain = catalog.addModel(piece_curtain, 0, prefixBuilding + "010" + suffix, curtainHeight);
+    curtain.addPossibility(0, catalog.addFile(prefixBuilding + "012" + suffix));
+
+    auto &floor = catalog.addModel(piece_floor, 0, prefixBuilding + "021" + suffix, floorHeight);
+    floor.addPossibility(0, catalog.addFile(prefixBuilding + "034" + suffix));
+    floor.addPossibility(0, catalog.addFile(prefixBuilding + "041" + suffix));
+    floor.addPossibility(0, catalog.addFile(prefixBuilding + "033" + suffix));
+    floor.addPossibility(0, catalog.addFile(prefixBuilding + "035" + suffix));
+    floor.addPossibility(0, catalog.addFile(prefixBuilding + "047" + suffix));
+    floor.addPossibility(0, catalog.addFile(prefixBuilding + "048" + suffix));
+    floor.addPossibility(0, catalog.addFile(prefixBuilding + "030" + suffix));
+    floor.addPossibility(0, catalog.addFile(prefixBuilding + "029" + suffix));
+    //floor.addPossibility(0, catalog.addFile(prefixBuilding + "042" + suffix));
+    floor.addPossibility(1, catalog.addFile(prefixBuilding + "039" + suffix));
+    floor.addPossibility(1, catalog.addFile(prefixBuilding + "049" + suffix));
+    floor.addPossibility(1, catalog.addFile(prefixBuilding + "050" + suffix));
+
+    floor.addPossibility(2, catalog.addFile(prefixBuilding + "037" + suffix));
+
+
+    auto &roof = catalog.addModel(piece_roof, 0, prefixBuilding + "063" + suffix, voidOrigin);
+    roof.addPossibility(0, catalog.addFile(prefixBuilding + "064" + suffix));
+    roof.addPossibility(0, catalog.addFile(prefixBuilding + "032" + suffix));
+    roof.addPossibility(0, catalog.addFile(prefixBuilding + "051" + suffix));
+    roof.addPossibility(0, catalog.addFile(prefixBuilding + "011" + suffix));
+    roof.addPossibility(1, catalog.addFile(prefixBuilding + "045" + suffix));
+    roof.addPossibility(2, catalog.addFile(prefixBuilding + "0082" + suffix));
+    roof.addPossibility(2, catalog.addFile(prefixBuilding + "009" + suffix));
+    roof.addPossibility(2, catalog.addFile(prefixBuilding + "016" + suffix));
+
+
+    auto &road = catalog.addModel(piece_road, 0, prefixRoads + "162" + suffix, voidOrigin);
+    road.addPossibility(0, catalog.addFile(prefixRoads + "025" + suffix));
+
+    auto &crossing = catalog.addModel(piece_crossing, 0, prefixRoads + "141" + suffix, voidOrigin);
+    crossing.addPossibility(0, catalog.addFile(prefixRoads + "1501" + suffix));
+    crossing.addPossibility(0, catalog.addFile(prefixRoads + "1502" + suffix));
+    crossing.addPossibility(0, catalog.addFile(prefixRoads + "150" + suffix));
+    crossing.addPossibility(0, catalog.addFile(prefixRoads + "1501" + suffix));
+    crossing.addPossibility(0, catalog.addFile(prefixRoads + "1502" + suffix));
+    crossing.addPossibility(0, catalog.addFile(prefixRoads + "141" + suffix));
+    crossing.addPossibility(0, catalog.addFile(prefixRoads + "038" + suffix));
+    crossing.addPossibility(0, catalog.addFile(prefixRoads + "0382" + suffix));
+
+    catalog.addModel(piece_ground, 0, prefixRoads + "163" + suffix, voidOrigin);
+
+    auto &tree = catalog.addModel(piece_tree, 0, prefixRoads + "019" + suffix, voidOrigin);
+    tree.addPossibility(0, catalog.addFile(prefixRoads + "020" + suffix));
+
+    return catalog;
+};
+
+//Line of the log, it is written to cout in one piece when the statement ends, so the lines of the cities generated at
+//the same time by a batch are never mixed
+struct log_line {
+    ostringstream line;
+
+    template <typename T>
+    log_line &operator<<(const T &value) {
+        line << value;
+        return *this;
+    }
+
+    ~log_line() {
+        static mutex logMutex;
+        lock_guard<mutex> lock(logMutex);
+        cout << line.str() << flush;
+    }
+};
+
+//Event of the trace, a scope with its duration (phase 'X') or the value of a counter (phase 'C')
+struct trace_event {
+    const char *name;
+    char phase;
+    int64_t ts, dur;
+    int tid;
+    double value;
+};
+
+//Records the trace of the generation in the Chrome trace-event format, every thread writes to its own buffer so the
+//probes do not lock, the buffers are merged when the trace is saved
+struct city_tracer {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    //if false the probes of every building and object are skipped and only the phases are traced
+    bool detail = true;
+    mutex buffersMutex;
+    vector<unique_ptr<vector<trace_event>>> buffers;
+    atomic<size_t> assetsLoaded{0}, instancesEmitted{0};
+};
+
+//the tracer of the process, tracing is off when it is null
+city_tracer *tracer = nullptr;
+
+int64_t traceTime() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - tracer->start).count();
+}
+
+vector<trace_event> &traceBuffer(int &tid) {
+    thread_local vector<trace_event> *buffer = nullptr;
+    thread_local int bufferTid = 0;
+    if (!buffer) {
+        lock_guard<mutex> lock(tracer->buffersMutex);
+        tracer->buffers.push_back(unique_ptr<vector<trace_event>>(new vector<trace_event>()));
+        buffer = tracer->buffers.back().get();
+        bufferTid = (int) tracer->buffers.size();
+    }
+    tid = bufferTid;
+    return *buffer;
+}
+
+//Times the scope where it is declared, detail probes are in the functions called for every building or object
+struct trace_scope {
+    const char *name;
+    int64_t start = -1;
+
+    trace_scope(const char *name, bool detail = false) : name(name) {
+        if (tracer && (!detail || tracer->detail)) start = traceTime();
+    }
+
+    ~trace_scope() { end(); }
+
+    //ends the scope before its end, for the phases that declare variables used after them
+    void end() {
+        if (start < 0) return;
+        auto tid = 0;
+        auto &buffer = traceBuffer(tid);
+        buffer.push_back(trace_event{name, 'X', start, traceTime() - start, tid, 0});
+        start = -1;
+    }
+
+    trace_scope(const trace_scope &) = delete;
+    trace_scope &operator=(const trace_scope &) = delete;
+};
+
+//records the actual value of a counter
+void trace_counter(const char *name, double value) {
+    if (!tracer) return;
+    auto tid = 0;
+    auto &buffer = traceBuffer(tid);
+    buffer.push_back(trace_event{name, 'C', traceTime(), 0, tid, value});
+}
+
+void save_trace(const string &filename) {
+    auto fs = ofstream(filename);
+    if (!fs) throw runtime_error("cannot open filename " + filename);
+    lock_guard<mutex> lock(tracer->buffersMutex);
+    fs << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    fs << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"city_generator\"}}";
+    for (auto &buffer : tracer->buffers) {
+        for (auto &event : *buffer) {
+            fs << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"" << event.phase << "\", \"ts\": " << event.ts
+               << ", \"pid\": 1, \"tid\": " << event.tid;
+            if (event.phase == 'X') fs << ", \"dur\": " << event.dur << "}";
+            else fs << ", \"args\": {\"value\": " << (int64_t) event.value << "}}";
+        }
+    }
+    fs << "\n]}\n";
+}
+
+//Rappresents a kit model already parsed and flattened, ready to be copied in the scene
+struct obj_asset {
+    //materials declared in the mtl of the model
+    vector<material> materials;
+    //shapes of all the objects of the model in file order
+    vector<obj_shape> shapes;
+};
+
+//Returns the parsed model of filename, the obj is loaded and flattened only the first time it is requested
+//and then shared by the whole process
+const obj_asset *get_asset(const string &filename) {
+    static map<string, unique_ptr<obj_asset>> assets;
+    static mutex assetsMutex;
+
+    lock_guard<mutex> lock(assetsMutex);
+    auto &asset = assets[filename];
+    if (asset) return asset.get();
+
+    trace_scope probe("load_asset");
+    asset = unique_ptr<obj_asset>(new obj_asset());
+    auto obj = unique_ptr<obj_scene>(load_obj(filename)); //Load Object_scene from filename
+    for (auto *mat : obj->materials) {
+        auto matn = material{mat->name};
+        matn.kd = mat->kd;
+        matn.ke = mat->ke;
+        asset->materials.push_back(matn);
+    }
+    for (auto *object : obj->objects) {
+        //the mesh is not deleted since yocto does not define ~obj_mesh, this happens only once per file
+        auto *mesh = get_mesh(obj.get(), *object, false);
+        for (auto &shpe : mesh->shapes) asset->shapes.push_back(move(shpe));
+        mesh->shapes.clear();
+    }
+    if (tracer) trace_counter("assets loaded", (double) ++tracer->assetsLoaded);
+    return asset.get();
+}
+
+//Instances placed by the generator as a structure of arrays, a row for every placed piece instead of a heap instance,
+//they become instances of the scene only when it is saved or rendered, look at add_instances
+//the pieces placed by one add_obj share their name, the name of a row is names[nameIds[row]] followed by its suffix,
+//the rows without shape were removed by regenerate and are skipped.
+//The columns differ from plain ids on purpose: the shape pointer is the id of the shape, since the baked and batched
+//shapes are made by the fragments in parallel and numbers would have to be remapped by append; the material is the one
+//of the shape, so there is no column for it; the names are not interned in a map, every name holds the cell that
+//placed it and is almost never repeated, so they are stored once per add_obj in the order of the rows, which is what
+//truncate and append rely on
+struct instance_table {
+    static const uint32_t noSuffix = 0xffffffff;
+
+    vector<frame3f> frames;
+    vector<shape *> shapes;
+    vector<uint32_t> nameIds, suffixes;
+    vector<string> names;
+
+    size_t size() const { return frames.size(); }
+
+    string name(size_t row) const {
+        auto &name = names[nameIds[row]];
+        return suffixes[row] == noSuffix ? name : name + to_string(suffixes[row]);
+    }
+
+    uint32_t addName(const string &name) {
+        names.push_back(name);
+        return (uint32_t) names.size() - 1;
+    }
+
+    void add(const frame3f &frame, shape *shp, uint32_t nameId, uint32_t suffix = noSuffix) {
+        frames.push_back(frame);
+        shapes.push_back(shp);
+        nameIds.push_back(nameId);
+        suffixes.push_back(suffix);
+    }
+
+    //keeps the first rows, the names are added in the order of the rows so the ones of the removed rows go too
+    void truncate(size_t rows) {
+        if (rows >= size()) return;
+        names.resize(nameIds[rows]);
+        frames.resize(rows);
+        shapes.resize(rows);
+        nameIds.resize(rows);
+        suffixes.resize(rows);
+    }
+
+    //moves the rows of other at the end of the table
+    void append(instance_table &other) {
+        auto base = (uint32_t) names.size();
+        names.insert(names.end(), make_move_iterator(other.names.begin()), make_move_iterator(other.names.end()));
+        frames.insert(frames.end(), other.frames.begin(), other.frames.end());
+        shapes.insert(shapes.end(), other.shapes.begin(), other.shapes.end());
+        suffixes.insert(suffixes.end(), other.suffixes.begin(), other.suffixes.end());
+        for (auto id : other.nameIds) nameIds.push_back(base + id);
+        other.clear();
+    }
+
+    void clear() { *this = instance_table(); }
+};
+
+//Calls f for the instances of the scene and then for the rows of the table, as they are after add_instances
+void for_each_instance(const scene *scn, const instance_table &rows,
+                       const function<void(const string &, const frame3f &, const shape *)> &f) {
+    for (auto *ist : scn->instances) f(ist->name, ist->frame, ist->shp);
+    for (auto row = (size_t) 0; row < rows.size(); row++)
+        if (rows.shapes[row]) f(rows.name(row), rows.frames[row], rows.shapes[row]);
+}
+
+//Adds to the scene an instance for every row of the table and empties it
+void add_instances(scene *scn, instance_table &rows) {
+    trace_scope probe("add_instances");
+    scn->instances.reserve(scn->instances.size() + rows.size());
+    for (auto row = (size_t) 0; row < rows.size(); row++)
+        if (rows.shapes[row]) scn->instances.push_back(new instance{rows.name(row), rows.frames[row], rows.shapes[row]});
+    rows.clear();
+}
+
+//Writes the city in the obj format while it is generated, the same format of save_scene so it is loaded back the same
+//shapes and materials are written the first time they are used and instances are written as soon as they are placed,
+//then they are released, so the memory only holds the part of the city that is being generated
+struct city_writer {
+    fstream obj, mtl;
+    //vertices already written, the obj indices are global to the file
+    int npos = 0, ntexcoord = 0, nnorm = 0;
+    set<const shape *> shapes;
+    set<const material *> materials;
+};
+
+unique_ptr<city_writer> make_writer(const string &filename) {
+    auto writer = unique_ptr<city_writer>(new city_writer());
+    auto basename = filename.substr(0, filename.rfind('.'));
+    writer->obj.open(filename, ios_base::out);
+    writer->mtl.open(basename + ".mtl", ios_base::out);
+    if (!writer->obj || !writer->mtl) throw runtime_error("cannot open filename " + filename);
+    writer->obj << "mtllib " << path_basename(filename) << ".mtl\n";
+    return writer;
+}
+
+//same conversion of save_scene for the specular roughness materials
+void write_material(city_writer *writer, const material *mat) {
+    if (!mat || !writer->materials.insert(mat).second) return;
+    auto &fs = writer->mtl;
+    fs << "newmtl " << mat->name << "\n";
+    fs << "  illum " << (mat->op < 1 || mat->kt != zero3f ? 4 : 2) << "\n";
+    if (mat->ke != zero3f) fs << "  Ke " << mat->ke.x << " " << mat->ke.y << " " << mat->ke.z << "\n";
+    if (mat->kd != zero3f) fs << "  Kd " << mat->kd.x << " " << mat->kd.y << " " << mat->kd.z << "\n";
+    if (mat->ks != zero3f) fs << "  Ks " << mat->ks.x << " " << mat->ks.y << " " << mat->ks.z << "\n";
+    if (mat->kr != zero3f) fs << "  Kr " << mat->kr.x << " " << mat->kr.y << " " << mat->kr.z << "\n";
+    if (mat->kt != zero3f) fs << "  Tf " << mat->kt.x << " " << mat->kt.y << " " << mat->kt.z << "\n";
+    fs << "  Ns " << (mat->rs ? 2 / pow(mat->rs, 4.0f) - 2 : 1e6f) << "\n";
+    if (mat->op != 1) fs << "  d " << mat->op << "\n";
+    if (mat->kd_txt.txt) fs << "  map_Kd " << mat->kd_txt.txt->path << "\n";
+    fs << "\n";
+}
+
+//writes the vertex of an element, only with the attributes the shape has
+void write_vertex(city_writer *writer, const shape *shp, int vid) {
+    auto &fs = writer->obj;
+    fs << " " << writer->npos + vid + 1;
+    if (!shp->texcoord.empty() || !shp->norm.empty()) fs << "/";
+    if (!shp->texcoord.empty()) fs << writer->ntexcoord + vid + 1;
+    if (!shp->norm.empty()) fs << "/" << writer->nnorm + vid + 1;
+}
+
+void write_shape(city_writer *writer, const shape *shp) {
+    if (!writer->shapes.insert(shp).second) return;
+    write_material(writer, shp->mat);
+    auto &fs = writer->obj;
+    for (auto &v : shp->pos) fs << "v " << v.x << " " << v.y << " " << v.z << "\n";
+    for (auto &v : shp->texcoord) fs << "vt " << v.x << " " << v.y << "\n";
+    for (auto &v : shp->norm) fs << "vn " << v.x << " " << v.y << " " << v.z << "\n";
+    fs << "o " << shp->name << "\n";
+    if (shp->mat) fs << "usemtl " << shp->mat->name << "\n";
+    for (auto point : shp->points) {
+        fs << "p";
+        write_vertex(writer, shp, point);
+        fs << "\n";
+    }
+    for (auto &line : shp->lines) {
+        fs << "l";
+        for (auto vid : line) write_vertex(writer, shp, vid);
+        fs << "\n";
+    }
+    for (auto &triangle : shp->triangles) {
+        fs << "f";
+        for (auto vid : triangle) write_vertex(writer, shp, vid);
+        fs << "\n";
+    }
+    for (auto &quad : shp->quads) {
+        fs << "f";
+        for (auto i = 0; i < (quad.z == quad.w ? 3 : 4); i++) write_vertex(writer, shp, quad[i]);
+        fs << "\n";
+    }
+    writer->npos += (int) shp->pos.size();
+    writer->ntexcoord += (int) shp->texcoord.size();
+    writer->nnorm += (int) shp->norm.size();
+}
+
+void write_camera(city_writer *writer, const camera *cam) {
+    auto &f = cam->frame;
+    writer->obj << "c " << cam->name << " " << cam->ortho << " " << cam->yfov << " " << cam->aspect << " "
+                << cam->aperture << " " << cam->focus;
+    for (auto &v : {f.x, f.y, f.z, f.o}) writer->obj << " " << v.x << " " << v.y << " " << v.z;
+    writer->obj << "\n";
+}
+
+//writes the rows of the table, and their shapes if they are new, then empties it
+void write_instances(city_writer *writer, instance_table &rows) {
+    trace_scope probe("write_instances");
+    for (auto row = (size_t) 0; row < rows.size(); row++) {
+        auto *shp = rows.shapes[row];
+        if (!shp) continue;
+        write_shape(writer, shp);
+        auto &f = rows.frames[row];
+        writer->obj << "i " << rows.name(row) << " " << shp->name;
+        for (auto &v : {f.x, f.y, f.z, f.o}) writer->obj << " " << v.x << " " << v.y << " " << v.z;
+        writer->obj << "\n";
+    }
+    rows.clear();
+    if (tracer) trace_counter("bytes written", (double) (writer->obj.tellp() + writer->mtl.tellp()));
+}
+
+//deletes a shape already written, it is forgotten by the writer since a new shape can take its address
+void release_shape(city_writer *writer, shape *shp) {
+    writer->shapes.erase(shp);
+    delete shp;
+}
+
+//flushes and closes the files, the writer is deleted by its owner
+void close_writer(city_writer *writer) {
+    trace_scope probe("close_writer");
+    if (tracer) trace_counter("bytes written", (double) (writer->obj.tellp() + writer->mtl.tellp()));
+    writer->obj.close();
+    writer->mtl.close();
+}
+
+//Appends data to the single binary buffer of a glb and returns the accessor that reads it
+glTFid<glTFAccessor> add_accessor(glTF *gltf, glTFAccessorType type, glTFAccessorComponentType ctype, int count,
+                                  int size, const void *data, glTFBufferViewTarget target) {
+    auto *buffer = gltf->buffers[0];
+    auto *view = new glTFBufferView();
+    view->buffer = glTFid<glTFBuffer>(0);
+    view->byteOffset = (int) buffer->data.size();
+    view->byteLength = count * size;
+    view->target = target;
+    buffer->data.insert(buffer->data.end(), (const unsigned char *) data, (const unsigned char *) data + count * size);
+    //every view starts 4 bytes aligned
+    buffer->data.resize((buffer->data.size() + 3) / 4 * 4);
+    buffer->byteLength = (int) buffer->data.size();
+    gltf->bufferViews.push_back(view);
+
+    auto *accessor = new glTFAccessor();
+    accessor->bufferView = glTFid<glTFBufferView>((int) gltf->bufferViews.size() - 1);
+    accessor->componentType = ctype;
+    accessor->count = count;
+    accessor->type = type;
+    gltf->accessors.push_back(accessor);
+    return glTFid<glTFAccessor>((int) gltf->accessors.size() - 1);
+}
+
+//Saves the scene as a binary gltf, every shape is stored once in the binary chunk as a mesh and every instance is a
+//node that references it, so the kit meshes are shared by all the buildings like in the obj instances
+//the rows of the table are saved as nodes too, without adding them to the scene
+void save_glb(const string &filename, const scene *scn, const instance_table &rows = {}) {
+    auto gltf = unique_ptr<glTF>(new glTF());
+    gltf->asset = new glTFAsset();
+    gltf->asset->generator = "city_generator";
+    gltf->asset->version = "2.0";
+    //the buffer without uri is the binary chunk of the glb
+    gltf->buffers.push_back(new glTFBuffer());
+
+    auto materialIds = unordered_map<const material *, int>();
+    for (auto *mat : scn->materials) {
+        auto *gmat = new glTFMaterial();
+        gmat->name = mat->name;
+        gmat->emissiveFactor = mat->ke;
+        gmat->pbrMetallicRoughness = new glTFMaterialPbrMetallicRoughness();
+        gmat->pbrMetallicRoughness->baseColorFactor = {mat->kd.x, mat->kd.y, mat->kd.z, mat->op};
+        gmat->pbrMetallicRoughness->metallicFactor = 0;
+        gmat->pbrMetallicRoughness->roughnessFactor = (mat->ks == zero3f) ? 1 : mat->rs;
+        gmat->doubleSided = mat->double_sided;
+        materialIds[mat] = (int) gltf->materials.size();
+        gltf->materials.push_back(gmat);
+    }
+
+    auto meshIds = unordered_map<const shape *, int>();
+    for (auto *shp : scn->shapes) {
+        auto *gprim = new glTFMeshPrimitive();
+        if (shp->mat) gprim->material = glTFid<glTFMaterial>(materialIds.at(shp->mat));
+        auto attribute = [&](const char *name, glTFAccessorType type, int count, int size, const void *data) {
+            if (count) gprim->attributes[name] = add_accessor(gltf.get(), type, glTFAccessorComponentType::Float,
+                                                             count, size, data, glTFBufferViewTarget::ArrayBuffer);
+        };
+        attribute("POSITION", glTFAccessorType::Vec3, (int) shp->pos.size(), sizeof(vec3f), shp->pos.data());
+        attribute("NORMAL", glTFAccessorType::Vec3, (int) shp->norm.size(), sizeof(vec3f), shp->norm.data());
+        attribute("TEXCOORD_0", glTFAccessorType::Vec2, (int) shp->texcoord.size(), sizeof(vec2f),
+                  shp->texcoord.data());
+        //the position accessor needs its bounds
+        if (!shp->pos.empty()) {
+            auto bounds = make_bbox(shp->pos.size(), shp->pos.data());
+            auto *accessor = gltf->get(gprim->attributes["POSITION"]);
+            accessor->min = {bounds.min.x, bounds.min.y, bounds.min.z};
+            accessor->max = {bounds.max.x, bounds.max.y, bounds.max.z};
+        }
+
+        auto elements = vector<int>();
+        if (!shp->points.empty()) {
+            elements.assign(shp->points.begin(), shp->points.end());
+            gprim->mode = glTFMeshPrimitiveMode::Points;
+        } else if (!shp->triangles.empty()) {
+            auto *data = (const int *) shp->triangles.data();
+            elements.assign(data, data + shp->triangles.size() * 3);
+        } else if (!shp->quads.empty()) {
+            auto triangles = convert_quads_to_triangles(shp->quads);
+            auto *data = (const int *) triangles.data();
+            elements.assign(data, data + triangles.size() * 3);
+        } else {
+            delete gprim;
+            continue;
+        }
+        gprim->indices = add_accessor(gltf.get(), glTFAccessorType::Scalar, glTFAccessorComponentType::UnsignedInt,
+                                      (int) elements.size(), sizeof(int), elements.data(),
+                                      glTFBufferViewTarget::ElementArrayBuffer);
+
+        auto *gmesh = new glTFMesh();
+        gmesh->name = shp->name;
+        gmesh->primitives.push_back(gprim);
+        meshIds[shp] = (int) gltf->meshes.size();
+        gltf->meshes.push_back(gmesh);
+    }
+
+    auto *gscene = new glTFScene();
+    gscene->name = "city";
+    auto addNode = [&](glTFNode *gnode) {
+        gscene->nodes.push_back(glTFid<glTFNode>((int) gltf->nodes.size()));
+        gltf->nodes.push_back(gnode);
+    };
+
+    for_each_instance(scn, rows, [&](const string &name, const frame3f &frame, const shape *shp) {
+        auto mesh = meshIds.find(shp);
+        if (mesh == meshIds.end()) return;
+        auto *gnode = new glTFNode();
+        gnode->name = name;
+        gnode->mesh = glTFid<glTFMesh>(mesh->second);
+        gnode->matrix = to_mat4f(frame);
+        addNode(gnode);
+    });
+
+    for (auto *cam : scn->cameras) {
+        auto *gcam = new glTFCamera();
+        gcam->name = cam->name;
+        gcam->type = glTFCameraType::Perspective;
+        gcam->perspective = new glTFCameraPerspective();
+        gcam->perspective->yfov = cam->yfov;
+        gcam->perspective->aspectRatio = cam->aspect;
+        gcam->perspective->znear = cam->near;
+        gcam->perspective->zfar = cam->far;
+        gltf->cameras.push_back(gcam);
+
+        auto *gnode = new glTFNode();
+        gnode->name = cam->name;
+        gnode->camera = glTFid<glTFCamera>((int) gltf->cameras.size() - 1);
+        gnode->matrix = to_mat4f(cam->frame);
+        addNode(gnode);
+    }
+
+    gltf->scenes.push_back(gscene);
+    gltf->scene = glTFid<glTFScene>(0);
+
+    save_binary_gltf(filename, gltf.get(), true, false);
+}
+
+//Binary city format: a header and page aligned sections with the tables of the scene and the flat arrays of the shapes,
+//a loaded city maps the file and copies every array with a single memcpy, without parsing
+const char cityMagic[8] = {'Y', 'C', 'I', 'T', 'Y', 'B', 'I', 'N'};
+const uint32_t cityVersion = 1;
+const uint64_t cityPageSize = 4096;
+
+enum city_section {
+    section_strings, section_materials, section_shapes, section_vertices, section_elements, section_instances,
+    section_cameras, section_count
+};
+
+struct city_header {
+    char magic[8];
+    uint32_t version, pageSize;
+    uint64_t offset[section_count], size[section_count];
+};
+
+//a string in the strings section
+struct city_string {
+    uint64_t offset, length;
+};
 
-    auto *base = new model{0, prefixBuilding + "026a" + suffix, baseHeight};
-    base->addPossibility(0, prefixBuilding + "025a" + suffix);
-    base->addPossibility(0, prefixBuilding + "025b" + suffix);
-    base->addPossibility(1, prefixBuilding + "038" + suffix);
-    base->addPossibility(1, prefixBuilding + "038a" + suffix);
-    base->addPossibility(1, prefixBuilding + "038b" + suffix);
-    base->addPossibility(2, prefixBuilding + "022" + suffix);
+//a range of the vertices section, in floats, or of the elements section, in ints
+struct city_array {
+    uint64_t offset, count;
+};
 
-    base->setHeight(1, floorHeight);
-    base->setHeight(2, floorHeight);
+struct city_material_record {
+    city_string name;
+    vec3f ke, kd, ks;
+    float rs, op;
+    int32_t doubleSided;
+};
 
-    modelsMap["base"] = base;
+struct city_shape_record {
+    city_string name;
+    int64_t material;
+    city_array pos, norm, texcoord, points, triangles, quads;
+};
 
-    auto *block = new model{0, prefixBuilding + "005" + suffix, blockHeight};
-    block->addPossibility(1, prefixBuilding + "017" + suffix);
+struct city_instance_record {
+    city_string name;
+    int64_t shape;
+    frame3f frame;
+};
 
+struct city_camera_record {
+    city_string name;
+    frame3f frame;
+    float yfov, aspect, focus, aperture, near, far;
+    int32_t ortho;
+};
 
-    modelsMap["block"] = block;
+//Saves the scene in the binary city format, the vertices and the elements are written straight from the shapes
+//and the instances are followed by the rows of the table
+void save_city(const string &filename, const scene *scn, const instance_table &rows = {}) {
+    auto strings = vector<char>();
+    auto addString = [&strings](const string &str) {
+        auto result = city_string{strings.size(), str.size()};
+        strings.insert(strings.end(), str.begin(), str.end());
+        return result;
+    };
+
+    auto materialIds = unordered_map<const material *, int64_t>();
+    auto materials = vector<city_material_record>(scn->materials.size());
+    for (auto i = 0; i < scn->materials.size(); i++) {
+        auto *mat = scn->materials[i];
+        materials[i] = {addString(mat->name), mat->ke, mat->kd, mat->ks, mat->rs, mat->op, mat->double_sided};
+        materialIds[mat] = i;
+    }
 
+    auto shapeIds = unordered_map<const shape *, int64_t>();
+    auto shapes = vector<city_shape_record>(scn->shapes.size());
+    uint64_t vertices = 0, elements = 0;
+    auto addArray = [](uint64_t &size, size_t count) {
+        auto result = city_array{size, count};
+        size += count;
+        return result;
+    };
+    for (auto i = 0; i < scn->shapes.size(); i++) {
+        auto *shp = scn->shapes[i];
+        auto &record = shapes[i];
+        record.name = addString(shp->name);
+        record.material = shp->mat ? materialIds.at(shp->mat) : -1;
+        record.pos = addArray(vertices, shp->pos.size() * 3);
+        record.norm = addArray(vertices, shp->norm.size() * 3);
+        record.texcoord = addArray(vertices, shp->texcoord.size() * 2);
+        record.points = addArray(elements, shp->points.size());
+        record.triangles = addArray(elements, shp->triangles.size() * 3);
+        record.quads = addArray(elements, shp->quads.size() * 4);
+        shapeIds[shp] = i;
+    }
 
-    auto *curtain = new model{0, prefixBuilding + "010" + suffix, curtainHeight};
-    curtain->addPossibility(0, prefixBuilding + "012" + suffix);
-    modelsMap["curtain"] = curtain;
+    auto instances = vector<city_instance_record>();
+    instances.reserve(scn->instances.size() + rows.size());
+    for_each_instance(scn, rows, [&](const string &name, const frame3f &frame, const shape *shp) {
+        instances.push_back({addString(name), shapeIds.at(shp), frame});
+    });
+
+    //the record ends with padding, the fields are set one by one so the padding stays zero as the vector made it
+    auto cameras = vector<city_camera_record>(scn->cameras.size());
+    for (auto i = 0; i < scn->cameras.size(); i++) {
+        auto *cam = scn->cameras[i];
+        auto &record = cameras[i];
+        record.name = addString(cam->name);
+        record.frame = cam->frame;
+        record.yfov = cam->yfov;
+        record.aspect = cam->aspect;
+        record.focus = cam->focus;
+        record.aperture = cam->aperture;
+        record.near = cam->near;
+        record.far = cam->far;
+        record.ortho = cam->ortho;
+    }
 
-    auto *floor = new model{0, prefixBuilding + "021" + suffix, floorHeight};
-    floor->addPossibility(0, prefixBuilding + "034" + suffix);
-    floor->addPossibility(0, prefixBuilding + "041" + suffix);
-    floor->addPossibility(0, prefixBuilding + "033" + suffix);
-    floor->addPossibility(0, prefixBuilding + "035" + suffix);
-    floor->addPossibility(0, prefixBuilding + "047" + suffix);
-    floor->addPossibility(0, prefixBuilding + "048" + suffix);
-    floor->addPossibility(0, prefixBuilding + "030" + suffix);
-    floor->addPossibility(0, prefixBuilding + "029" + suffix);
-    //floor->addPossibility(0, prefixBuilding + "042" + suffix);
-    floor->addPossibility(1, prefixBuilding + "039" + suffix);
-    floor->addPossibility(1, prefixBuilding + "049" + suffix);
-    floor->addPossibility(1, prefixBuilding + "050" + suffix);
+    auto header = city_header();
+    memcpy(header.magic, cityMagic, sizeof(cityMagic));
+    header.version = cityVersion;
+    header.pageSize = (uint32_t) cityPageSize;
+    header.size[section_strings] = strings.size();
+    header.size[section_materials] = materials.size() * sizeof(city_material_record);
+    header.size[section_shapes] = shapes.size() * sizeof(city_shape_record);
+    header.size[section_vertices] = vertices * sizeof(float);
+    header.size[section_elements] = elements * sizeof(int);
+    header.size[section_instances] = instances.size() * sizeof(city_instance_record);
+    header.size[section_cameras] = cameras.size() * sizeof(city_camera_record);
+    auto offset = cityPageSize;
+    for (auto i = 0; i < section_count; i++) {
+        header.offset[i] = offset;
+        offset += (header.size[i] + cityPageSize - 1) / cityPageSize * cityPageSize;
+    }
 
-    floor->addPossibility(2, prefixBuilding + "037" + suffix);
+    auto file = fstream(filename, ios::out | ios::binary);
+    if (!file) throw runtime_error("cannot write city " + filename);
+    auto write = [&file](const void *data, size_t size) {
+        if (size) file.write((const char *) data, size);
+    };
+    auto section = [&](city_section sec) {
+        while ((uint64_t) file.tellp() < header.offset[sec]) file.put(0);
+    };
+    write(&header, sizeof(header));
+    section(section_strings);
+    write(strings.data(), strings.size());
+    section(section_materials);
+    write(materials.data(), header.size[section_materials]);
+    section(section_shapes);
+    write(shapes.data(), header.size[section_shapes]);
+    section(section_vertices);
+    for (auto *shp : scn->shapes) {
+        write(shp->pos.data(), shp->pos.size() * sizeof(vec3f));
+        write(shp->norm.data(), shp->norm.size() * sizeof(vec3f));
+        write(shp->texcoord.data(), shp->texcoord.size() * sizeof(vec2f));
+    }
+    section(section_elements);
+    for (auto *shp : scn->shapes) {
+        write(shp->points.data(), shp->points.size() * sizeof(int));
+        write(shp->triangles.data(), shp->triangles.size() * sizeof(vec3i));
+        write(shp->quads.data(), shp->quads.size() * sizeof(vec4i));
+    }
+    section(section_instances);
+    write(instances.data(), header.size[section_instances]);
+    section(section_cameras);
+    write(cameras.data(), header.size[section_cameras]);
+    if (!file) throw runtime_error("cannot write city " + filename);
+    if (tracer) trace_counter("bytes written", (double) file.tellp());
+}
 
-    modelsMap["floor"] = floor;
+//Loads a scene saved in the binary city format, the file is mapped in memory and the arrays of the shapes are copied
+//from the mapping, the names and the tables are the only data that is decoded
+scene *load_city(const string &filename) {
+    trace_scope probe("load_city");
+#ifndef _WIN32
+    auto fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("cannot open city " + filename);
+    struct stat info;
+    fstat(fd, &info);
+    auto size = (size_t) info.st_size;
+    auto *mapping = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) throw runtime_error("cannot map city " + filename);
+    auto *data = (const char *) mapping;
+#else
+    auto file = fstream(filename, ios::in | ios::binary | ios::ate);
+    if (!file) throw runtime_error("cannot open city " + filename);
+    auto contents = vector<char>((size_t) file.tellg());
+    file.seekg(0);
+    file.read(contents.data(), contents.size());
+    auto size = contents.size();
+    auto *data = (const char *) contents.data();
+#endif
+
+#ifndef _WIN32
+    //the file is unmapped however the loader returns
+    auto unmap = unique_ptr<void, function<void(void *)>>(mapping, [size](void *p) { munmap(p, size); });
+#endif
+
+    //every field of the file is checked before it is used, a bad file is rejected and never indexed
+    auto check = [&filename](bool valid) {
+        if (!valid) throw runtime_error("invalid city " + filename);
+    };
+    auto inside = [](uint64_t offset, uint64_t count, uint64_t total) {
+        return offset <= total && count <= total - offset;
+    };
+
+    auto header = city_header();
+    check(size >= sizeof(header));
+    memcpy(&header, data, sizeof(header));
+    check(!memcmp(header.magic, cityMagic, sizeof(cityMagic)) && header.version == cityVersion);
+    for (auto i = 0; i < section_count; i++) check(inside(header.offset[i], header.size[i], size));
+
+    auto *strings = data + header.offset[section_strings];
+    auto *vertices = (const float *) (data + header.offset[section_vertices]);
+    auto *elements = (const int *) (data + header.offset[section_elements]);
+    auto count = [&header](city_section sec, size_t size) { return (size_t) (header.size[sec] / size); };
+    auto getString = [&](const city_string &str) {
+        check(inside(str.offset, str.length, header.size[section_strings]));
+        return string(strings + str.offset, str.length);
+    };
+    auto scn = unique_ptr<scene>(new scene());
+    auto *materials = (const city_material_record *) (data + header.offset[section_materials]);
+    for (auto i = 0; i < count(section_materials, sizeof(city_material_record)); i++) {
+        auto &record = materials[i];
+        auto name = getString(record.name);
+        auto *mat = new material{name};
+        scn->materials.push_back(mat);
+        mat->ke = record.ke;
+        mat->kd = record.kd;
+        mat->ks = record.ks;
+        mat->rs = record.rs;
+        mat->op = record.op;
+        mat->double_sided = record.doubleSided != 0;
+    }
 
-    auto *roof = new model{0, prefixBuilding + "063" + suffix, voidOrigin};
-    roof->addPossibility(0, prefixBuilding + "064" + suffix);
-    roof->addPossibility(0, prefixBuilding + "032" + suffix);
-    roof->addPossibility(0, prefixBuilding + "051" + suffix);
-    roof->addPossibility(0, prefixBuilding + "011" + suffix);
-    roof->addPossibility(1, prefixBuilding + "045" + suffix);
-    roof->addPossibility(2, prefixBuilding + "0082" + suffix);
-    roof->addPossibility(2, prefixBuilding + "009" + suffix);
-    roof->addPossibility(2, prefixBuilding + "016" + suffix);
+    auto *shapes = (const city_shape_record *) (data + header.offset[section_shapes]);
+    for (auto i = 0; i < count(section_shapes, sizeof(city_shape_record)); i++) {
+        auto &record = shapes[i];
+        auto name = getString(record.name);
+        auto *shp = new shape{name};
+        scn->shapes.push_back(shp);
+        check(record.material >= -1 && record.material < (int64_t) scn->materials.size());
+        if (record.material >= 0) shp->mat = scn->materials[record.material];
+        //the arrays are counted in floats or ints, the values are vectors of them
+        auto range = [&](const auto *base, city_section sec, const city_array &array, auto &values) {
+            auto width = sizeof(*values.data()) / sizeof(*base);
+            check(inside(array.offset, array.count, count(sec, sizeof(*base))) && array.count % width == 0);
+            auto *begin = (decltype(values.data())) (base + array.offset);
+            values.assign(begin, begin + array.count / width);
+        };
+        range(vertices, section_vertices, record.pos, shp->pos);
+        range(vertices, section_vertices, record.norm, shp->norm);
+        range(vertices, section_vertices, record.texcoord, shp->texcoord);
+        range(elements, section_elements, record.points, shp->points);
+        range(elements, section_elements, record.triangles, shp->triangles);
+        range(elements, section_elements, record.quads, shp->quads);
+        auto vertex = [&](int vid) { check(vid >= 0 && vid < (int) shp->pos.size()); };
+        for (auto vid : shp->points) vertex(vid);
+        for (auto &triangle : shp->triangles)
+            for (auto vid : triangle) vertex(vid);
+        for (auto &quad : shp->quads)
+            for (auto vid : quad) vertex(vid);
+    }
 
-    modelsMap["roof"] = roof;
+    auto *instances = (const city_instance_record *) (data + header.offset[section_instances]);
+    scn->instances.reserve(count(section_instances, sizeof(city_instance_record)));
+    for (auto i = 0; i < count(section_instances, sizeof(city_instance_record)); i++) {
+        auto &record = instances[i];
+        check(record.shape >= 0 && record.shape < (int64_t) scn->shapes.size());
+        auto name = getString(record.name);
+        scn->instances.push_back(new instance{name, record.frame, scn->shapes[record.shape]});
+    }
 
-    auto *road = new model{0, prefixRoads + "162" + suffix, voidOrigin};
-    road->addPossibility(0, prefixRoads + "025" + suffix);
-    modelsMap["road"] = road;
+    auto *cameras = (const city_camera_record *) (data + header.offset[section_cameras]);
+    for (auto i = 0; i < count(section_cameras, sizeof(city_camera_record)); i++) {
+        auto &record = cameras[i];
+        auto name = getString(record.name);
+        auto *cam = new camera{name, record.frame, record.ortho != 0, record.yfov, record.aspect,
+                               record.focus, record.aperture, record.near, record.far};
+        scn->cameras.push_back(cam);
+    }
 
-    auto *crossing = new model{0, prefixRoads + "141" + suffix, voidOrigin};
-    crossing->addPossibility(0, prefixRoads + "1501" + suffix);
-    crossing->addPossibility(0, prefixRoads + "1502" + suffix);
-    crossing->addPossibility(0, prefixRoads + "150" + suffix);
-    crossing->addPossibility(0, prefixRoads + "1501" + suffix);
-    crossing->addPossibility(0, prefixRoads + "1502" + suffix);
-    crossing->addPossibility(0, prefixRoads + "141" + suffix);
-    crossing->addPossibility(0, prefixRoads + "038" + suffix);
-    crossing->addPossibility(0, prefixRoads + "0382" + suffix);
-    modelsMap["crossing"] = crossing;
+    return scn.release();
+}
 
-    modelsMap["ground"] = new model{0, prefixRoads + "163" + suffix, voidOrigin};
+//Saves a generated scene with the instances of the table, the format is chosen by the extension of the filename
+//glb and city read the table, the other formats need the instances in the scene
+void saveScene(const string &filename, scene *scn, instance_table &rows) {
+    auto extension = path_extension(filename);
+    if (extension == ".glb") save_glb(filename, scn, rows);
+    else if (extension == ".city") save_city(filename, scn, rows);
+    else {
+        add_instances(scn, rows);
+        save_scene(filename, scn, save_options{});
+    }
+}
 
-    auto *tree = new model{0, prefixRoads + "019" + suffix, voidOrigin};
-    tree->addPossibility(0, prefixRoads + "020" + suffix);
-    modelsMap["tree"] = tree;
+//Time spent in each phase of the generation, in seconds, and size of the generated city
+struct city_stats {
+    double roadsTime = 0, kitTime = 0, placementTime = 0, saveTime = 0, renderTime = 0;
+    size_t instances = 0, triangles = 0;
+};
 
-    return modelsMap;
+//Scene under generation, every kit model is added once as shapes and then placed only with instances
+struct city_scene {
+    scene *scn = nullptr;
+    //shapes already added to the scene for each model id of the catalog
+    vector<vector<shape *>> kitShapes;
+    //kit shapes of the road, crossing and ground tiles, the ones merged by batch_roads
+    set<const shape *> roadShapes;
+    //materials of the kit by their name, that is unique in the scene, look at intern_material
+    map<string, material *> kitMaterials;
+    //instances placed in the city, they are added to the scene only when it is saved or rendered
+    instance_table instances;
+    //if set the placed instances are written and released instead of being added to the table
+    unique_ptr<city_writer> writer;
+    city_stats stats;
+
+    //Chooses between the kit pieces and a proxy box for every building from its distance to the camera
+    struct lod_policy {
+        vec3f eye = zero3f;
+        //buildings farther than distance from the eye are proxies, 0 never uses them
+        float distance = 0;
+        int maxFloors = 0;
+        //boxes for every footprint from 1x1 to 3x3 cells and every number of floors, look at proxyIndex
+        vector<shape *> proxies;
+    } lod;
+
+    city_scene(scene *scn) : scn(scn) {}
 };
 
-//adds an object to the scene
-frame3f add_obj(scene *scn, string filename, string name, frame3f frame) {
-    auto *obj1 = load_obj(filename); //Load Object_scene from filename
+//moves the instances to the table of the city or, when the city is streamed, writes them
+//batched are the shapes made for these instances by batch_roads, they are added to the scene or released too
+void emit_instances(city_scene *city, instance_table &instances, const vector<shape *> &batched = {}) {
+    city->stats.instances += instances.size();
+    if (tracer) trace_counter("instances emitted", (double) (tracer->instancesEmitted += instances.size()));
+    for (auto *shp : instances.shapes) city->stats.triangles += shp->triangles.size() + 2 * shp->quads.size();
+    if (city->writer) {
+        auto saveTimer = timer();
+        write_instances(city->writer.get(), instances);
+        for (auto *shp : batched) release_shape(city->writer.get(), shp);
+        city->stats.saveTime += saveTimer.elapsed();
+    } else {
+        city->scn->shapes.insert(city->scn->shapes.end(), batched.begin(), batched.end());
+        city->instances.append(instances);
+    }
+}
+
+//true if the materials look the same, the name is not compared
+bool sameMaterial(const material &a, const material &b) {
+    return a.mtype == b.mtype && a.ke == b.ke && a.kd == b.kd && a.ks == b.ks && a.kr == b.kr && a.kt == b.kt &&
+           a.rs == b.rs && a.op == b.op && a.double_sided == b.double_sided;
+}
+
+//Returns the material of the scene with the name and the parameters of mat, adding a copy of mat the first time, so all
+//the kit models share one material for each name and parameters. The kit files reuse names like Stone for different
+//colors, the later ones are numbered as Stone_1, Stone_2 so the names stay unique in the mtl
+material *intern_material(city_scene *city, const material &mat) {
+    auto name = mat.name;
+    for (auto count = 1;; count++) {
+        auto it = city->kitMaterials.find(name);
+        if (it == city->kitMaterials.end()) break;
+        if (sameMaterial(*it->second, mat)) return it->second;
+        name = mat.name + "_" + to_string(count);
+    }
+    auto *interned = new material(mat);
+    interned->name = name;
+    city->scn->materials.push_back(interned);
+    city->kitMaterials[name] = interned;
+    return interned;
+}
+
+//Adds to the scene the shapes of the kit model filename with their interned materials and returns the shapes
+vector<shape *> get_kit_shapes(city_scene *city, const string &filename) {
+    auto *asset = get_asset(filename);
+    auto shapes = vector<shape *>();
     map<string, material *> materialMap;
-    map<string, obj_object *> objectsMap;
-    for (auto *mat : obj1->materials) {
-        auto matn = new material{mat->name};
-        matn->kd = mat->kd;
-        matn->ke = mat->ke;
-        scn->materials.push_back(matn);
-        materialMap[mat->name] = matn;
+    for (auto &mat : asset->materials) materialMap[mat.name] = intern_material(city, mat);
+
+    int count = 0;
+    for (auto &shpe : asset->shapes) {
+
+        auto shp = new shape{path_basename(filename) + "_" + to_string(count++)};
+
+        //Creating new shape from the loaded one
+        shp->mat = materialMap[shpe.matname];
+        shp->triangles = shpe.triangles;
+        shp->points = shpe.points;
+        shp->lines = shpe.lines;
+        shp->pos = shpe.pos;
+        shp->norm = shpe.norm;
+        shp->texcoord = shpe.texcoord;
+        shp->quads = shpe.tetras;
+        shp->color = shpe.color;
+
+        city->scn->shapes.push_back(shp);
+        shapes.push_back(shp);
+    }
+    return shapes;
+}
+
+//Adds to the scene the shapes of all the models of the kit, so that the workers only have to read them
+//and the order of the shapes does not depend on which worker places a model first
+void add_kit(city_scene *city, const model_catalog &catalog) {
+    city->kitShapes.clear();
+    for (auto &filename : catalog.filenames) city->kitShapes.push_back(get_kit_shapes(city, filename));
+    for (auto piece : {piece_road, piece_crossing, piece_ground})
+        for (auto &possibility : catalog[piece].possibilities)
+            for (auto id : possibility) city->roadShapes.insert(city->kitShapes[id].begin(), city->kitShapes[id].end());
+}
+
+//Removes the kit shapes that were never placed and the materials left without shapes
+void remove_unused_shapes(city_scene *city) {
+    auto *scn = city->scn;
+    set<shape *> usedShapes;
+    for (auto *ist : scn->instances) usedShapes.insert(ist->shp);
+    usedShapes.insert(city->instances.shapes.begin(), city->instances.shapes.end());
+    for (auto &shapes : city->kitShapes)
+        if (!shapes.empty() && !usedShapes.count(shapes.front())) shapes.clear();
+
+    set<material *> usedMaterials;
+    auto shapes = vector<shape *>();
+    for (auto *shp : scn->shapes) {
+        if (usedShapes.count(shp)) {
+            shapes.push_back(shp);
+            usedMaterials.insert(shp->mat);
+        } else delete shp;
     }
+    scn->shapes = shapes;
+
+    auto materials = vector<material *>();
+    for (auto *mat : scn->materials) {
+        if (usedMaterials.count(mat)) materials.push_back(mat);
+        else {
+            if (city->kitMaterials.count(mat->name) && city->kitMaterials.at(mat->name) == mat)
+                city->kitMaterials.erase(mat->name);
+            delete mat;
+        }
+    }
+    scn->materials = materials;
+}
 
-    for (auto *obj : obj1->objects) {
+const int proxyMaxSide = 3;
 
-        int count = 0;
-        for (auto shpe : get_mesh(obj1, *obj, false)->shapes) {
+int proxyIndex(const city_scene::lod_policy &lod, int countX, int countY, int floors) {
+    return ((countX - 1) * proxyMaxSide + countY - 1) * lod.maxFloors + min(floors, lod.maxFloors) - 1;
+}
 
-            auto shp = new shape{name + to_string(count++)};
+//Adds the proxy boxes of the buildings to the scene and sets the distance from the camera after which they are used
+//a box covers the footprint of the building and is as high as its floors, its origin is the corner of the first cell
+void add_proxies(city_scene *city, float distance, int maxFloors) {
+    auto &lod = city->lod;
+    lod.distance = distance;
+    lod.maxFloors = maxFloors;
+    if (!city->scn->cameras.empty()) lod.eye = city->scn->cameras.front()->frame.o;
+
+    auto mat = new material{"building_proxy"};
+    mat->kd = {0.62f, 0.6f, 0.56f};
+    city->scn->materials.push_back(mat);
+    vector<vec4i> quads;
+    vector<vec3f> pos, norm;
+    vector<vec2f> texcoord;
+    tie(quads, pos, norm, texcoord) = make_uvcube(0);
+    lod.proxies.resize(proxyMaxSide * proxyMaxSide * maxFloors);
+    for (auto countX = 1; countX <= proxyMaxSide; countX++) {
+        for (auto countY = 1; countY <= proxyMaxSide; countY++) {
+            for (auto floors = 1; floors <= maxFloors; floors++) {
+                auto size = vec3f{(float) countX, 0.21f + 0.62f * floors, (float) countY};
+                auto shp = new shape{"proxy_" + to_string(countX) + "x" + to_string(countY) + "_" + to_string(floors)};
+                shp->mat = mat;
+                shp->quads = quads;
+                shp->norm = norm;
+                shp->texcoord = texcoord;
+                for (auto &p : pos) shp->pos.push_back((p + vec3f{1, 1, 1}) * 0.5f * size);
+                city->scn->shapes.push_back(shp);
+                lod.proxies[proxyIndex(lod, countX, countY, floors)] = shp;
+            }
+        }
+    }
+}
 
-            //Creating new shape from the loaded one
-            shp->mat = materialMap[shpe.matname];
-            shp->triangles = shpe.triangles;
-            shp->points = shpe.points;
-            shp->lines = shpe.lines;
-            shp->pos = shpe.pos;
-            shp->norm = shpe.norm;
-            shp->texcoord = shpe.texcoord;
-            shp->quads = shpe.tetras;
-            shp->color = shpe.color;
+//true if the shape can be merged with others: it has faces and its vertices have all the same attributes
+bool isMergeable(const shape *shp) {
+    return shp->points.empty() && shp->lines.empty() &&
+           (shp->texcoord.empty() || shp->texcoord.size() == shp->pos.size()) &&
+           (shp->norm.empty() || shp->norm.size() == shp->pos.size());
+}
 
-            scn->shapes.push_back(shp);
-            scn->instances.push_back(new instance{shp->name, frame, shp});
+//appends the faces of shp moved by frame to merged, the merged vertices have all the attributes and the missing
+//ones are zero, quads are split in triangles
+void append_shape(shape *merged, const shape *shp, const frame3f &frame) {
+    auto offset = (int) merged->pos.size();
+    for (auto &p : shp->pos) merged->pos.push_back(transform_point(frame, p));
+    for (auto vid = 0; vid < shp->pos.size(); vid++) {
+        merged->norm.push_back(shp->norm.empty() ? zero3f : transform_direction(frame, shp->norm[vid]));
+        merged->texcoord.push_back(shp->texcoord.empty() ? zero2f : shp->texcoord[vid]);
+    }
+    for (auto &t : shp->triangles) merged->triangles.push_back({t.x + offset, t.y + offset, t.z + offset});
+    for (auto &t : convert_quads_to_triangles(shp->quads))
+        merged->triangles.push_back({t.x + offset, t.y + offset, t.z + offset});
+}
 
+//Merges the road tiles of a chunk of the city in one shape for each material with the vertices already moved
+//in place, the instances of the tiles are replaced by one instance for each of these shapes that are returned
+//only the shapes made of triangles are merged
+vector<shape *> batch_roads(const city_scene *city, instance_table &instances, const string &chunk) {
+    trace_scope probe("batch_roads");
+    auto batched = vector<shape *>();
+    map<material *, shape *> batches;
+    //the kept rows keep their name ids, so the names move to the new table as they are
+    auto kept = instance_table();
+    kept.names = move(instances.names);
+    for (auto row = (size_t) 0; row < instances.size(); row++) {
+        auto *shp = instances.shapes[row];
+        if (!city->roadShapes.count(shp) || !shp->quads.empty() || !isMergeable(shp)) {
+            kept.add(instances.frames[row], shp, instances.nameIds[row], instances.suffixes[row]);
+            continue;
         }
+        auto &batch = batches[shp->mat];
+        if (!batch) {
+            //materials of different kit files can have the same name, so the batches are numbered
+            batch = new shape{"roads_" + chunk + "_" + to_string(batched.size())};
+            batch->mat = shp->mat;
+            batched.push_back(batch);
+        }
+        append_shape(batch, shp, instances.frames[row]);
     }
+    for (auto *shp : batched) kept.add(identity_frame3f, shp, kept.addName(shp->name));
+    instances = move(kept);
+    return batched;
+}
+
+//Part of the city placed by one worker, its instances are moved to the scene when all the workers are done
+struct city_fragment {
+    const city_scene *city = nullptr;
+    instance_table instances;
+    //position of the cell (0,0) of the grid and prefix of the instance names, used by the tiles of the infinite city
+    vec3f offset = zero3f;
+    string prefix;
+    //every visited cell that placed something and the index of its first instance
+    vector<pair<vec2i, size_t>> cells;
+    //shapes made by bake_building for the instances of the fragment
+    vector<shape *> shapes;
+};
+
+//adds an object to the fragment as instances of the shared kit shapes
+frame3f add_obj(city_fragment *frag, model_id id, const string &name, frame3f frame) {
+    trace_scope probe("add_obj", true);
+    auto count = 0u;
+    auto placed = frame3f{frame.x, frame.y, frame.z, frame.o + frag->offset};
+    auto nameId = frag->instances.addName(frag->prefix + name);
+    for (auto *shp : frag->city->kitShapes[id]) frag->instances.add(placed, shp, nameId, count++);
     return frame;
+}
 
+//Merges the pieces of the building placed by the cell (x,y), the instances of the fragment from first on, in one shape
+//for each material in the space of the building, they are placed by one instance each at the corner of the cell
+//so the top level of the bvh sees a few instances for the building instead of one for every piece of every floor
+void bake_building(city_fragment *frag, size_t first, int x, int y) {
+    trace_scope probe("bake_building", true);
+    if (frag->instances.size() - first < 2) return;
+    auto frame = frame3f{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}, vec3f{(float) x, 0, (float) y - 1} + frag->offset};
+    auto toBuilding = inverse(frame);
+    auto baked = vector<shape *>();
+    map<material *, shape *> bakes;
+    auto &rows = frag->instances;
+    auto kept = instance_table();
+    for (auto row = first; row < rows.size(); row++) {
+        auto *shp = rows.shapes[row];
+        if (!isMergeable(shp)) {
+            kept.add(rows.frames[row], shp, kept.addName(rows.names[rows.nameIds[row]]), rows.suffixes[row]);
+            continue;
+        }
+        auto &bake = bakes[shp->mat];
+        if (!bake) {
+            bake = new shape{frag->prefix + "building_" + to_string(x) + "_" + to_string(y) + "_" +
+                             to_string(baked.size())};
+            bake->mat = shp->mat;
+            baked.push_back(bake);
+        }
+        append_shape(bake, shp, toBuilding * rows.frames[row]);
+    }
+    rows.truncate(first);
+    rows.append(kept);
+    for (auto *shp : baked) rows.add(frame, shp, rows.addName(shp->name));
+    frag->shapes.insert(frag->shapes.end(), baked.begin(), baked.end());
+}
+
+//true if the building of countX x countY cells from (x,y) is far enough from the camera to be a proxy
+bool useProxy(const city_fragment *frag, int x, int y, int countX, int countY) {
+    auto &lod = frag->city->lod;
+    if (lod.distance <= 0) return false;
+    auto center = vec3f{x + countX * 0.5f, 0, y - 1 + countY * 0.5f} + frag->offset;
+    return length(center - lod.eye) > lod.distance;
+}
 
+//adds the proxy box in place of the kit pieces of a building
+void add_proxy(city_fragment *frag, int x, int y, int countX, int countY, int floors, const string &name) {
+    auto &lod = frag->city->lod;
+    auto *shp = lod.proxies[proxyIndex(lod, countX, countY, floors)];
+    auto frame = frame3f{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}, vec3f{(float) x, 0, (float) y - 1} + frag->offset};
+    frag->instances.add(frame, shp, frag->instances.addName(frag->prefix + name));
 }
 
 //Creates a frame in position (xi,yi) and rotates it with the desired angle moving the object to make it be same origin as the GLOBAL system of this generator
@@ -264,262 +1345,380 @@ frame3f rotateFrame(float angle, int xi, int yi) {
 
 //Recursively creates a building adding for each floor a model and adding the roof when maxFloorNumber is reached
 //and can create different type of buildings putting together only the pieces that fit for that type
-int recursiveCreateBuilding(scene *scn, int type, string prefix, int maxFloors, int actualFloor, frame3f frame,
-                            vec3f height, map<string, model *> modelsMap, int roofType, map<int, float> rotations,
-                            int roofRotation, int xi, int yi, bool noBase, int floorType) {
+int recursiveCreateBuilding(city_fragment *frag, rng_pcg32 &rng, int type, string prefix, int maxFloors, int actualFloor,
+                            frame3f frame, vec3f height, const model_catalog &catalog, int roofType,
+                            const map<int, float> &rotations, int roofRotation, int xi, int yi, bool noBase, int floorType) {
 
 
     if (maxFloors == actualFloor) {
 
-        auto *m = modelsMap["roof"];
+        auto &m = catalog[piece_roof];
 
-        string filename;
+        model_id filename;
         if (roofType == -2) return 0;
         else if (roofType != -1) {
-            frame3f newf = rotateFrame(rotations[roofRotation], xi, yi);
+            frame3f newf = rotateFrame(rotations.at(roofRotation), xi, yi);
 
             newf.o.y = frame.o.y;
             frame = newf;
-            filename = m->possibilities.at(2).at(roofType);
+            filename = m.possibilities.at(2).at(roofType);
         } else {
-            filename = m->getRandomPossibility(type);
+            filename = m.getRandomPossibility(rng, type);
         }
-        add_obj(scn, filename, prefix + to_string(actualFloor),
-                {frame.x, frame.y, frame.z, frame.o + m->getHeight(type) + height});
+        add_obj(frag, filename, prefix + to_string(actualFloor),
+                {frame.x, frame.y, frame.z, frame.o + m.getHeight(type) + height});
         return 0;
     }
     frame3f newFrame;
 
-    string filename;
-    model *model;
+    const model *model;
 
-    string modelFilename;
+    model_id modelFilename;
     vec3f newHeight;
     bool newH = false;
     if (actualFloor == 0 && noBase) {
-        model = modelsMap["block"];
-        modelFilename = model->getRandomPossibility(0);
+        model = &catalog[piece_block];
+        modelFilename = model->getRandomPossibility(rng, 0);
 
     } else if (actualFloor == 0 || noBase && actualFloor == 1) {
-        model = modelsMap["base"];
+        model = &catalog[piece_base];
         if (noBase) {
 
             if (floorType == -1)
-                modelFilename = modelsMap["floor"]->getRandomPossibility(0);
+                modelFilename = catalog[piece_floor].getRandomPossibility(rng, 0);
             else
-                modelFilename = modelsMap["floor"]->possibilities.at(0).at(floorType);
+                modelFilename = catalog[piece_floor].possibilities.at(0).at(floorType);
 
             newH = true;
             newHeight = model->getHeight(2);
 
         } else {
-            vector<string> possib = model->possibilities.at(0);
-            modelFilename = possib.at(random(maxFloors > 2 ? 0 : 1, possib.size() - 1));
+            auto &possib = model->possibilities.at(0);
+            modelFilename = possib.at(random(rng, maxFloors > 2 ? 0 : 1, possib.size() - 1));
         }
 
     } else if (actualFloor == 3 && type == 1) {
-        model = modelsMap["floor"];
-        modelFilename = model->getRandomPossibility(2);
+        model = &catalog[piece_floor];
+        modelFilename = model->getRandomPossibility(rng, 2);
 
 
     } else if ((actualFloor % 2 == 0 || actualFloor == 1 && !noBase) && type == 1) {
-        model = modelsMap["block"];
-        modelFilename = actualFloor == 2 ? model->getRandomPossibility(0) : model->getRandomPossibility(type);
+        model = &catalog[piece_block];
+        modelFilename = actualFloor == 2 ? model->getRandomPossibility(rng, 0) : model->getRandomPossibility(rng, type);
 
     } else if (type == 0 && ((actualFloor == 1 || noBase && actualFloor == 2 ||
                               (actualFloor > 1 &&
                                (noBase && actualFloor % 2 == 0 || (!noBase && actualFloor % 2 == 1)))))) {
 
-        if (random(0, 100) > 80 && type == 0 && (actualFloor == 1 || noBase && actualFloor == 2)) {
-            model = modelsMap["curtain"];
-            modelFilename = model->getRandomPossibility();
+        if (random(rng, 0, 100) > 80 && type == 0 && (actualFloor == 1 || noBase && actualFloor == 2)) {
+            model = &catalog[piece_curtain];
+            modelFilename = model->getRandomPossibility(rng);
         } else {
-            model = modelsMap["block"];
-            modelFilename = model->getRandomPossibility(type);
+            model = &catalog[piece_block];
+            modelFilename = model->getRandomPossibility(rng, type);
         }
 
     } else {
-        model = modelsMap["floor"];
+        model = &catalog[piece_floor];
         if (floorType == -1)
-            modelFilename = modelsMap["floor"]->getRandomPossibility(type);
+            modelFilename = catalog[piece_floor].getRandomPossibility(rng, type);
         else
-            modelFilename = modelsMap["floor"]->possibilities.at(type).at(floorType);
+            modelFilename = catalog[piece_floor].possibilities.at(type).at(floorType);
     }
 
-    newFrame = add_obj(scn, modelFilename, prefix + to_string(actualFloor) + to_string(type),
+    newFrame = add_obj(frag, modelFilename, prefix + to_string(actualFloor) + to_string(type),
                        {frame.x, frame.y, frame.z, frame.o + height});
     if (!newH) height = model->getHeight(type);
     else height = newHeight;
 
-    recursiveCreateBuilding(scn, type, prefix, maxFloors, ++actualFloor, newFrame, height, modelsMap, roofType,
+    return recursiveCreateBuilding(frag, rng, type, prefix, maxFloors, ++actualFloor, newFrame, height, catalog, roofType,
                             rotations, roofRotation, xi, yi, noBase, floorType);
 
 }
 
 //METHOD OVERLOADING
-int recursiveCreateBuilding(scene *scn, int type, string prefix, int maxFloors, int actualFloor, frame3f frame,
-                            vec3f height, map<string, model *> modelsMap, int floorType) {
-    recursiveCreateBuilding(scn, type, prefix, maxFloors, actualFloor, frame, height, modelsMap, -1, {}, -1,
-                            -1, -1, false, floorType);
+int recursiveCreateBuilding(city_fragment *frag, rng_pcg32 &rng, int type, string prefix, int maxFloors, int actualFloor,
+                            frame3f frame, vec3f height, const model_catalog &catalog, int floorType) {
+    return recursiveCreateBuilding(frag, rng, type, prefix, maxFloors, actualFloor, frame, height, catalog, -1, {},
+                                   -1, -1, -1, false, floorType);
 
 }
 
+//Content of a cell of the city grid
+enum cell_type : uint8_t {
+    cell_road_y = 0, //road going along the y axis (directions 0 and 1)
+    cell_road_x = 2, //road going along the x axis (directions 2 and 3)
+    cell_empty = 5, //free cell where buildings and trees can be placed
+    cell_building = 6 //cell already used by a building
+};
+
+//Directions where a road leaves a cell
+enum cell_exit : uint8_t { exit_px = 1, exit_nx = 2, exit_py = 4, exit_ny = 8 };
+
+//Classes of the cells of a grid computed for all the cells at once by classifyCells, stored as bitplanes.
+//A block holds the planes of 64 cells along y in a cache line: the four exits of the cells, that are the roads around
+//them, and the four bits of their checkIncrocio class
+struct cell_classes {
+    enum plane { plane_px, plane_nx, plane_py, plane_ny, plane_crossing, plane_count = plane_crossing + 4 };
+
+    int height = 0, blocksY = 0;
+    vector<array<uint64_t, plane_count>> blocks;
+
+    const array<uint64_t, plane_count> &block(int x, int y) const { return blocks[(size_t) x * blocksY + (y >> 6)]; }
+
+    uint8_t exits(int x, int y) const {
+        auto &b = block(x, y);
+        auto bit = y & 63;
+        return (uint8_t) (((b[plane_px] >> bit) & 1) | (((b[plane_nx] >> bit) & 1) << 1) |
+                          (((b[plane_py] >> bit) & 1) << 2) | (((b[plane_ny] >> bit) & 1) << 3));
+    }
+
+    int crossing(int x, int y) const {
+        auto &b = block(x, y);
+        auto bit = y & 63;
+        auto result = 0;
+        for (auto i = 0; i < 4; i++) result |= (int) ((b[plane_crossing + i] >> bit) & 1) << i;
+        return result;
+    }
+};
+
+//Grid of the city allocated on the heap, one byte per cell
+//Cells are stored in square tiles so that the neighbors of a cell are near it in memory even on very large cities
+struct city_grid {
+    static const int tileBits = 4;
+    static const int tileSize = 1 << tileBits;
+    static const int tileMask = tileSize - 1;
+
+    int width = 0, height = 0;
+    int tilesX = 0, tilesY = 0;
+    vector<uint8_t> cells;
+    //coordinates in the whole city of the cell (0,0), not zero only for the tiles of the infinite city
+    vec2i origin = {0, 0};
+    //classes of the cells, computed by classifyCells once the roads are done
+    cell_classes classes;
+
+    city_grid() {}
+    city_grid(int width, int height, uint8_t value = cell_empty) : width(width), height(height) {
+        tilesX = (width + tileMask) >> tileBits;
+        tilesY = (height + tileMask) >> tileBits;
+        cells.assign((size_t) tilesX * tilesY * tileSize * tileSize, value);
+    }
+
+    bool inside(int x, int y) const {
+        return x >= 0 && y >= 0 && x < width && y < height;
+    }
+
+    size_t index(int x, int y) const {
+        auto tile = (size_t) (x >> tileBits) * tilesY + (y >> tileBits);
+        return (tile << (2 * tileBits)) + ((x & tileMask) << tileBits) + (y & tileMask);
+    }
+
+    uint8_t &at(int x, int y) { return cells[index(x, y)]; }
+
+    uint8_t at(int x, int y) const { return cells[index(x, y)]; }
+};
+
+//true if the cell is a road of any direction
+inline bool isRoad(uint8_t cell) {
+    return cell == cell_road_x || cell == cell_road_y;
+}
+
+//Size of the square regions of the grid where buildings and trees are placed in parallel
+const int regionSize = 32;
+
+//Region of the grid placed by one worker, buildings never cross its border so every region
+//can be placed alone; the cells taken by buildings are written to the grid only after all the workers are done
+struct city_region {
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    vector<bool> taken;
+    //cell whose building took each cell, the cells are taken by the cell being placed
+    vector<vec2i> owners;
+    vec2i placing = {-1, -1};
+
+    city_region(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1) {
+        taken.assign((size_t) (x1 - x0) * (y1 - y0), false);
+        owners.assign(taken.size(), {-1, -1});
+    }
+
+    bool isTaken(int x, int y) const { return taken[(size_t) (x - x0) * (y1 - y0) + (y - y0)]; }
+
+    vec2i owner(int x, int y) const { return owners[(size_t) (x - x0) * (y1 - y0) + (y - y0)]; }
+
+    void take(int x, int y) {
+        taken[(size_t) (x - x0) * (y1 - y0) + (y - y0)] = true;
+        owners[(size_t) (x - x0) * (y1 - y0) + (y - y0)] = placing;
+    }
+};
+
 //Utility method used to check the chance
-bool forkStreet(int forkChance) {
-    return random(0, 100) < forkChance;
+bool forkStreet(rng_pcg32 &rng, int forkChance) {
+    return random(rng, 0, 100) < forkChance;
+}
+
+//Road still to be walked by the road generator
+struct road_segment {
+    int x, y;
+    int dir;
+    int forkChance;
+    bool first;
+    bool justFork;
+    //set for the rest of a road stopped at a fork, it goes on from (x,y) with the end, count and forked it had
+    bool resume = false;
+    int end = 0, count = 0;
+    bool forked = false;
+};
+
+//Walks a single road starting from (seg.x, seg.y) in direction seg.dir and adds it to the matrix
+//at a fork the road stops and pushes on the pending stack the rest of itself and then the forks with HALVED chance,
+//so the forks are walked first and the road goes on after them, as when generateRoads recursed at the fork
+void walkRoad(city_grid &grid, rng_pcg32 &rng, const road_segment &seg, vector<road_segment> &pending) {
+    if (!seg.resume && (!grid.inside(seg.x, seg.y) || grid.at(seg.x, seg.y) != cell_empty)) return;
+
+    auto doubleForkChance = 30; //chance of double forking
+    auto count = seg.count;
+    auto forked = seg.forked;
+    auto justFork = seg.justFork;
+
+    //roads in direction 0 and 1 go along y, the others along x
+    auto alongY = seg.dir == 0 || seg.dir == 1;
+    auto code = alongY ? cell_road_y : cell_road_x;
+    auto side = alongY ? vec2i{1, 0} : vec2i{0, 1};
+    auto start = alongY ? seg.y : seg.x;
+    auto size = alongY ? grid.height : grid.width;
+    auto step = seg.dir == 0 || seg.dir == 2 ? 1 : -1;
+
+    //the road ends before position end
+    int end;
+    if (seg.resume) end = seg.end;
+    else if (step > 0) end = seg.first && seg.dir == 0 ? size : random(rng, start + (size - start) / 2, size);
+    else end = random(rng, 0, start / 2) - 1;
+
+    for (auto i = start; i != end; i += step) {
+        auto pos = alongY ? vec2i{seg.x, i} : vec2i{i, seg.y};
+        auto next = pos + side, prev = pos - side;
+        if ((grid.inside(next.x, next.y) && grid.at(next.x, next.y) == code) ||
+            (grid.inside(prev.x, prev.y) && grid.at(prev.x, prev.y) == code)) {
+            break;
+        }
+        grid.at(pos.x, pos.y) = code;
+        auto forkedBool = false;
+        if (forkStreet(rng, seg.forkChance) && !justFork && !forked && count++ > 0 && i != end - step) {
+            forked = true;
+            forkedBool = true;
+
+            //forks go perpendicular: along x from a road along y and the other way round
+            auto forkNext = road_segment{next.x, next.y, alongY ? 2 : 0, seg.forkChance / 2, false, true};
+            auto forkPrev = road_segment{prev.x, prev.y, alongY ? 3 : 1, seg.forkChance / 2, false, true};
+            auto rest = seg;
+            auto restPos = alongY ? vec2i{seg.x, i + step} : vec2i{i + step, seg.y};
+            rest.x = restPos.x, rest.y = restPos.y;
+            rest.justFork = false;
+            rest.resume = true;
+            rest.end = end, rest.count = count, rest.forked = true;
+            pending.push_back(rest);
+            if (random(rng, 0, 100) < doubleForkChance) // fork in all directions
+            {
+                pending.push_back(forkPrev);
+                pending.push_back(forkNext);
+            } else if (random(rng, 0, 1) == 0)
+                pending.push_back(forkNext);
+            else
+                pending.push_back(forkPrev);
+            return;
+        }
+        justFork = false;
+        if (!forkedBool) forked = false;
+    }
 }
 
 // Generates the roads in the matrix
 // starts from actual postion (x,y) and adds street to the matrix in direction -> dir
 // dir == 0 RIGHT; dir == 1 LEFT; dir == 2 UP; dir == 3 DOWN;
-// the road will fork in actual position with forkChance probability if it forks this method will be called recursivelly and the chance will be HALVED
-// in this way the streets will be created using the probability
+// the road will fork in actual position with forkChance probability, if it forks the new road is pushed with the chance HALVED
+// and the stack is walked until no road is left, in the same order of a recursive walk, in this way the streets will be created using the probability
 //all dagerous cases will stop the road for exampple if there is near actual position(x,y) another road of the same direction in this way we will avoid a map with only roads if the forkProbability is high
-int generateRoads(int *matrix, int x, int y, int n, int m, int dir, int forkChance, bool first, bool justFork) {
-    if (x <= n && y <= m && x >= 0 && y >= 0 && (matrix[x * n + y] == 5)) {
-        vector<int> possibleDirections;
-
-        auto doubleForkChance = 30; //chance of double forking
-        auto count = 0;
-        auto forked = false;
-
-        if (dir == 0) {
-            possibleDirections.push_back(2);
-            possibleDirections.push_back(3);
-            auto steps = first ? m : random(y + (m - y) / 2, m);
-            first = false;
-
-            for (auto yi = y; yi < steps; yi++) {
-                if (((x + 1 < n && matrix[(x + 1) * n + yi] == 0) || (x - 1 >= 0 && (matrix[(x - 1) * n + yi] == 0)))) {
-                    break;
-                }
-                matrix[x * n + yi] = 0;
-                auto forkedBool = false;
-                if (forkStreet(forkChance) && !justFork && !forked && count++ > 0 && yi != steps - 1) {
-
-                    forked = true;
-                    forkedBool = true;
-                    if (random(0, 100) < doubleForkChance) // fork in all directions
-                    {
-                        generateRoads(matrix, x + 1, yi, n, m, 2, forkChance / 2, first, true);
-                        generateRoads(matrix, x - 1, yi, n, m, 3, forkChance / 2, first, true);
-                    } else {
-                        int newdir = possibleDirections[random(0, possibleDirections.size())];
-                        if (newdir == 2)
-                            generateRoads(matrix, x + 1, yi, n, m, newdir, forkChance / 2, first, true);
-                        else if (newdir == 3)
-                            generateRoads(matrix, x - 1, yi, n, m, newdir, forkChance / 2, first, true);
-                    }
-                }
-                justFork = false;
-                if (!forkedBool) forked = false;
-            }
-        } else if (dir == 1) {
-            possibleDirections.push_back(2);
-            possibleDirections.push_back(3);
-
-            auto steps = random(0, y / 2);
-
-            for (auto yi = y; yi >= steps; yi--) {
-                if (((x + 1 < n && matrix[(x + 1) * n + yi] == 0) || (x - 1 >= 0 && (matrix[(x - 1) * n + yi] == 0)))) {
-                    break;
-                }
-                matrix[x * n + yi] = 0;
-                auto forkedBool = false;
-
-                if (forkStreet(forkChance) && !justFork && !forked && count++ > 0 && yi != steps) {
-                    forked = true;
-                    forkedBool = true;
-                    if (random(0, 100) < doubleForkChance) // fork in all directions
-                    {
-                        generateRoads(matrix, x + 1, yi, n, m, 2, forkChance / 2, first, true);
-                        generateRoads(matrix, x - 1, yi, n, m, 3, forkChance / 2, first, true);
-                    } else {
-                        int newdir = possibleDirections[random(0, possibleDirections.size())];
-
-                        if (newdir == 2)
-                            generateRoads(matrix, x + 1, yi, n, m, newdir, forkChance / 2, first, true);
-                        else
-                            generateRoads(matrix, x - 1, yi, n, m, newdir, forkChance / 2, first, true);
-                    }
-                }
-                justFork = false;
-                if (!forkedBool) forked = false;
-            }
-        } else if (dir == 2) {
-
-            possibleDirections.push_back(0);
-            possibleDirections.push_back(1);
+void generateRoads(city_grid &grid, rng_pcg32 &rng, int x, int y, int dir, int forkChance, bool first, bool justFork) {
+    trace_scope probe("generateRoads");
+    vector<road_segment> pending;
+    pending.push_back(road_segment{x, y, dir, forkChance, first, justFork});
+    while (!pending.empty()) {
+        auto seg = pending.back();
+        pending.pop_back();
+        walkRoad(grid, rng, seg, pending);
+    }
+}
 
-            auto steps = random(x + (n - x) / 2, n);
 
-            for (auto xi = x; xi < steps; xi++) {
-                if (((y + 1 < m && matrix[(xi) * n + y + 1] == 2) || (y - 1 >= 0 && (matrix[(xi) * n + y - 1] == 2)))) {
-                    break;
-                }
-                matrix[xi * n + y] = 2;
-                auto forkedBool = false;
-                if (forkStreet(forkChance) && !justFork && !forked && count++ > 0 && xi != steps - 1) {
-
-                    forked = true;
-                    forkedBool = true;
-
-                    if (random(0, 100) < doubleForkChance) // fork in all directions
-                    {
-                        generateRoads(matrix, xi, y + 1, n, m, 0, forkChance / 2, first, true);
-                        generateRoads(matrix, xi, y - 1, n, m, 1, forkChance / 2, first, true);
-                    } else {
-                        int newdir = possibleDirections[random(0, possibleDirections.size())];
-                        if (newdir == 0)
-                            generateRoads(matrix, xi, y + 1, n, m, newdir, forkChance / 2, first, true);
-                        else
-                            generateRoads(matrix, xi, y - 1, n, m, newdir, forkChance / 2, first, true);
-                    }
+//Computes the classes of all the cells of the grid in one sweep over 64 cells at a time. The road cells of every column
+//are packed in a bitplane for each direction, so the cells around a block are the blocks of the columns next to it
+//and the same block shifted by one bit, and every class is a few bitwise operations on whole blocks.
+//The byte grid stays the state written by the roads and the bitplanes are derived from it again on every call, so the
+//classes must be computed again if the roads change; the edits keep the roads, so it is called once per grid
+void classifyCells(city_grid &grid) {
+    trace_scope probe("classifyCells");
+    auto &classes = grid.classes;
+    classes.height = grid.height;
+    classes.blocksY = (grid.height + 63) >> 6;
+    auto blocksY = classes.blocksY;
+    auto planes = [&](int x) { return (size_t) x * blocksY; };
+
+    //roads along x and along y, with the bits past the height left to zero. The cells are read in the order of the
+    //tiles of the grid, a column of a tile is 16 bits of a block since the tiles never cross a block
+    auto roadX = vector<uint64_t>(planes(grid.width + 2), 0), roadY = roadX;
+    auto *cells = grid.cells.data();
+    for (auto tx = 0; tx < grid.tilesX; tx++)
+        for (auto ty = 0; ty < grid.tilesY; ty++)
+            for (auto xi = 0; xi < city_grid::tileSize; xi++, cells += city_grid::tileSize) {
+                auto x = (tx << city_grid::tileBits) + xi;
+                if (x >= grid.width) continue;
+                auto bitsX = (uint64_t) 0, bitsY = (uint64_t) 0;
+                for (auto yi = 0; yi < city_grid::tileSize; yi++) {
+                    bitsX |= (uint64_t) (cells[yi] == cell_road_x) << yi;
+                    bitsY |= (uint64_t) (cells[yi] == cell_road_y) << yi;
                 }
-                justFork = false;
-                if (!forkedBool) forked = false;
+                auto y = ty << city_grid::tileBits;
+                roadX[planes(x + 1) + (y >> 6)] |= bitsX << (y & 63);
+                roadY[planes(x + 1) + (y >> 6)] |= bitsY << (y & 63);
             }
-        } else {
-            possibleDirections.push_back(0);
-            possibleDirections.push_back(1);
 
-            auto steps = random(0, x / 2);
-            for (auto xi = x; xi >= steps; xi--) {
-                if (((y + 1 < m && matrix[(xi) * n + y + 1] == 2) || (y - 1 >= 0 && (matrix[(xi) * n + y - 1] == 2)))) {
-                    break;
-                }
-                matrix[xi * n + y] = 2;
-                auto forkedBool = false;
-
-                if (forkStreet(forkChance) && !justFork && !forked && count++ > 0 && xi != steps) {
-
-                    forked = true;
-                    forkedBool = true;
-                    if (random(0, 100) < doubleForkChance) // fork in all directions
-                    {
-                        generateRoads(matrix, xi, y + 1, n, m, 0, forkChance / 2, first, true);
-                        generateRoads(matrix, xi, y - 1, n, m, 1, forkChance / 2, first, true);
-                    } else {
-                        int newdir = possibleDirections[random(0, possibleDirections.size())];
-                        if (newdir == 0)
-                            generateRoads(matrix, xi, y + 1, n, m, newdir, forkChance / 2, first, true);
-                        else
-                            generateRoads(matrix, xi, y - 1, n, m, newdir, forkChance / 2, first, true);
-                    }
-                }
-                justFork = false;
-                if (!forkedBool) forked = false;
-
-
-            }
+    //up has in the bit of every cell the cell at y + 1, down the cell at y - 1
+    auto up = [blocksY](const uint64_t *column, int b) {
+        return (column[b] >> 1) | (b + 1 < blocksY ? column[b + 1] << 63 : 0);
+    };
+    auto down = [](const uint64_t *column, int b) { return (column[b] << 1) | (b > 0 ? column[b - 1] >> 63 : 0); };
+
+    classes.blocks.assign(planes(grid.width), {});
+    for (auto x = 0; x < grid.width; x++) {
+        //columns x - 1, x and x + 1 are at x, x + 1 and x + 2 in the planes, the columns out of the grid are empty
+        auto *xl = &roadX[planes(x)], *xc = &roadX[planes(x + 1)], *xr = &roadX[planes(x + 2)];
+        auto *yl = &roadY[planes(x)], *yc = &roadY[planes(x + 1)], *yr = &roadY[planes(x + 2)];
+        for (auto b = 0; b < blocksY; b++) {
+            auto &block = classes.blocks[planes(x) + b];
+            auto roadUp = up(xc, b) | up(yc, b), roadDown = down(xc, b) | down(yc, b);
+            auto roadRight = xr[b] | yr[b], roadLeft = xl[b] | yl[b];
+            block[cell_classes::plane_px] = roadRight;
+            block[cell_classes::plane_nx] = roadLeft;
+            block[cell_classes::plane_py] = roadUp;
+            block[cell_classes::plane_ny] = roadDown;
+
+            //checkIncrocio of the cells of a road: one and two are added for the crossing roads on the sides, three
+            //more if the road goes on, and when nothing crosses it the end of the road is seven, the start eight
+            auto classify = [&block](uint64_t road, uint64_t one, uint64_t two, uint64_t ahead, uint64_t aheadRoad,
+                                     uint64_t behindRoad) {
+                auto side = one | two, on = ahead & side;
+                auto end = road & ~side & ~aheadRoad, start = road & ~side & aheadRoad & ~behindRoad;
+                one &= road, two &= road;
+                block[cell_classes::plane_crossing] |= (one & ~two & ~on) | (one & two & ~on) | (~one & two & on) | end;
+                block[cell_classes::plane_crossing + 1] |= (~one & two & ~on) | (one & two) | end;
+                block[cell_classes::plane_crossing + 2] |= (one & on) | (two & on) | end;
+                block[cell_classes::plane_crossing + 3] |= start;
+            };
+            classify(yc[b], xl[b], xr[b], up(yc, b), roadUp, roadDown);
+            classify(xc[b], up(yc, b), down(yc, b), xr[b], roadRight, roadLeft);
         }
-
-    } else {
-        return 0;
     }
 }
 
-
 //This method cheks the positions around the input position and the output is:
 //0 if there are no crossroads
 //1 if there is a crossroad at right
@@ -530,26 +1729,181 @@ int generateRoads(int *matrix, int x, int y, int n, int m, int dir, int forkChan
 //6 if there is a total crossroad
 //7 end of road
 //8 end of road inverse
-int checkIncrocio(int matrix[], int x, int y, int n, int m, int dir) {
-    auto incroci = 0;
-    if (dir == 0) {
-        if (x + 1 < n && matrix[(x + 1) * n + y] == 2)
-            incroci += 2;
-        if (x - 1 >= 0 && matrix[(x - 1) * n + y] == 2)
-            incroci += 1;
-        if (y + 1 < m && matrix[x * n + y + 1] == 0 && incroci != 0) incroci += 3;
-        if (((y + 1 < m && matrix[x * n + y + 1] == 5) || y + 1 == m) && incroci == 0) incroci += 7;
-        if (((y - 1 >= 0 && matrix[x * n + y - 1] == 5) || y - 1 < 0) && incroci == 0) incroci += 8;
-    } else if (dir == 2) {
-        if (y + 1 < m && matrix[x * n + y + 1] == 0)
-            incroci += 1;
-        if (y - 1 >= 0 && matrix[x * n + y - 1] == 0)
-            incroci += 2;
-        if (x + 1 < n && matrix[(x + 1) * n + y] == 2 && incroci != 0) incroci += 3;
-        if (((x + 1 < n && matrix[(x + 1) * n + y] == 5) || x + 1 == n) && incroci == 0) incroci += 7;
-        if (((x - 1 >= 0 && matrix[(x - 1) * n + y] == 5) || x - 1 < 0) && incroci == 0) incroci += 8;
-    }
-    return incroci;
+int checkIncrocio(const city_grid &grid, int x, int y) {
+    return grid.classes.crossing(x, y);
+}
+
+//Road network of a grid as a graph. The nodes are the road cells where roads cross, turn or end, that are the cells
+//where checkIncrocio can find something, and the segments are the straight runs of road cells from a node to the next one.
+//The segments are indexed by a uniform grid of square buckets, every bucket lists the segments that cross its cells
+struct road_graph {
+    static const int bucketBits = 4;
+    static const int bucketMask = (1 << bucketBits) - 1;
+
+    struct node {
+        vec2i cell;
+        uint8_t exits;
+    };
+
+    //the cells of a segment go along x or y from the cell of from, the lower one, to the cell of to
+    struct segment {
+        int from, to;
+        bool alongX;
+        int length;
+    };
+
+    int width = 0, height = 0;
+    int bucketsX = 0, bucketsY = 0;
+    //nodes sorted by x and then by y
+    vector<node> nodes;
+    vector<segment> segments;
+    //one bit for every cell, set for the nodes
+    vector<uint64_t> nodeBits;
+    //the segments of the bucket b are bucketSegments from bucketStart[b] to bucketStart[b + 1] excluded
+    vector<int> bucketStart, bucketSegments;
+
+    size_t bit(int x, int y) const { return (size_t) x * height + y; }
+
+    bool isNode(int x, int y) const {
+        auto b = bit(x, y);
+        return (nodeBits[b >> 6] >> (b & 63)) & 1;
+    }
+
+    //node of the cell (x,y), -1 if the cell is not a node
+    int nodeAt(int x, int y) const {
+        if (!isNode(x, y)) return -1;
+        auto it = lower_bound(nodes.begin(), nodes.end(), vec2i{x, y}, [](const node &n, const vec2i &c) {
+            return n.cell.x < c.x || (n.cell.x == c.x && n.cell.y < c.y);
+        });
+        return (int) (it - nodes.begin());
+    }
+};
+
+//true if the road goes straight through the cell along its own direction, the only road cells that are not nodes
+bool isStraightRoad(uint8_t cell, uint8_t exits) {
+    return (cell == cell_road_y && exits == (exit_py | exit_ny)) ||
+           (cell == cell_road_x && exits == (exit_px | exit_nx));
+}
+
+//Builds the road graph of the grid with one pass over the cells for the nodes and one walk for every segment,
+//the segments are only walked towards growing x and y so every one of them is found once
+road_graph buildRoadGraph(const city_grid &grid) {
+    trace_scope probe("buildRoadGraph");
+    auto graph = road_graph();
+    graph.width = grid.width;
+    graph.height = grid.height;
+    graph.nodeBits.assign(((size_t) grid.width * grid.height + 63) / 64, 0);
+    for (auto x = 0; x < grid.width; x++)
+        for (auto y = 0; y < grid.height; y++) {
+            auto cell = grid.at(x, y);
+            if (!isRoad(cell)) continue;
+            auto exits = grid.classes.exits(x, y);
+            if (isStraightRoad(cell, exits)) continue;
+            auto b = graph.bit(x, y);
+            graph.nodeBits[b >> 6] |= (uint64_t) 1 << (b & 63);
+            graph.nodes.push_back({{x, y}, exits});
+        }
+
+    for (auto from = 0; from < graph.nodes.size(); from++)
+        for (auto alongX : {true, false}) {
+            if (!(graph.nodes[from].exits & (alongX ? exit_px : exit_py))) continue;
+            auto step = alongX ? vec2i{1, 0} : vec2i{0, 1};
+            auto cell = graph.nodes[from].cell + step;
+            auto length = 1;
+            while (isStraightRoad(grid.at(cell.x, cell.y), grid.classes.exits(cell.x, cell.y))) {
+                cell += step;
+                length++;
+            }
+            graph.segments.push_back({from, graph.nodeAt(cell.x, cell.y), alongX, length});
+        }
+
+    //the buckets are filled in two passes, counting the segments of every bucket and then writing them
+    graph.bucketsX = (grid.width + road_graph::bucketMask) >> road_graph::bucketBits;
+    graph.bucketsY = (grid.height + road_graph::bucketMask) >> road_graph::bucketBits;
+    auto forBuckets = [&graph](const road_graph::segment &seg, const function<void(int)> &f) {
+        auto a = graph.nodes[seg.from].cell, b = graph.nodes[seg.to].cell;
+        for (auto bx = a.x >> road_graph::bucketBits; bx <= b.x >> road_graph::bucketBits; bx++)
+            for (auto by = a.y >> road_graph::bucketBits; by <= b.y >> road_graph::bucketBits; by++)
+                f(bx * graph.bucketsY + by);
+    };
+    graph.bucketStart.assign((size_t) graph.bucketsX * graph.bucketsY + 1, 0);
+    for (auto &seg : graph.segments) forBuckets(seg, [&graph](int b) { graph.bucketStart[b + 1]++; });
+    for (auto b = 0; b + 1 < graph.bucketStart.size(); b++) graph.bucketStart[b + 1] += graph.bucketStart[b];
+    graph.bucketSegments.resize(graph.bucketStart.back());
+    auto next = vector<int>(graph.bucketStart.begin(), graph.bucketStart.end() - 1);
+    for (auto i = 0; i < graph.segments.size(); i++)
+        forBuckets(graph.segments[i], [&](int b) { graph.bucketSegments[next[b]++] = i; });
+    return graph;
+}
+
+//Segments with at least a cell in the cells from (x0,y0) to (x1,y1) excluded, in the order of the graph
+vector<int> segmentsIn(const road_graph &graph, int x0, int y0, int x1, int y1) {
+    auto result = vector<int>();
+    x0 = max(x0, 0), y0 = max(y0, 0), x1 = min(x1, graph.width), y1 = min(y1, graph.height);
+    if (x0 >= x1 || y0 >= y1) return result;
+    for (auto bx = x0 >> road_graph::bucketBits; bx <= (x1 - 1) >> road_graph::bucketBits; bx++)
+        for (auto by = y0 >> road_graph::bucketBits; by <= (y1 - 1) >> road_graph::bucketBits; by++) {
+            auto b = bx * graph.bucketsY + by;
+            for (auto i = graph.bucketStart[b]; i < graph.bucketStart[b + 1]; i++) {
+                auto id = graph.bucketSegments[i];
+                auto &seg = graph.segments[id];
+                auto a = graph.nodes[seg.from].cell, c = graph.nodes[seg.to].cell;
+                if (a.x < x1 && c.x >= x0 && a.y < y1 && c.y >= y0) result.push_back(id);
+            }
+        }
+    sort(result.begin(), result.end());
+    result.erase(unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+//Same result of segmentsIn by looking at every segment of the graph, used to check the buckets in the debug builds
+vector<int> segmentsInScan(const road_graph &graph, int x0, int y0, int x1, int y1) {
+    auto result = vector<int>();
+    for (auto id = 0; id < graph.segments.size(); id++) {
+        auto &seg = graph.segments[id];
+        auto a = graph.nodes[seg.from].cell, c = graph.nodes[seg.to].cell;
+        if (a.x < x1 && c.x >= x0 && a.y < y1 && c.y >= y0) result.push_back(id);
+    }
+    return result;
+}
+
+//Saves the road graph as json, the nodes are [x, y, exits] and the segments [from, to, length]
+//only the segments with a cell in area, from (x,y) to (z,w) excluded, are saved together with their nodes and the
+//nodes in the area, and the nodes are numbered again in the order of the graph; an empty area is the whole grid
+void saveRoadGraph(const string &filename, const road_graph &graph, vec4i area) {
+    if (area.x >= area.z || area.y >= area.w) area = {0, 0, graph.width, graph.height};
+    auto ids = segmentsIn(graph, area.x, area.y, area.z, area.w);
+    assert(ids == segmentsInScan(graph, area.x, area.y, area.z, area.w));
+
+    auto kept = vector<int>();
+    for (auto id : ids) {
+        kept.push_back(graph.segments[id].from);
+        kept.push_back(graph.segments[id].to);
+    }
+    auto first = lower_bound(graph.nodes.begin(), graph.nodes.end(), area.x,
+                             [](const road_graph::node &n, int x) { return n.cell.x < x; });
+    for (auto it = first; it != graph.nodes.end() && it->cell.x < area.z; it++)
+        if (it->cell.y >= area.y && it->cell.y < area.w) kept.push_back((int) (it - graph.nodes.begin()));
+    sort(kept.begin(), kept.end());
+    kept.erase(unique(kept.begin(), kept.end()), kept.end());
+    auto number = [&kept](int node) { return (int) (lower_bound(kept.begin(), kept.end(), node) - kept.begin()); };
+
+    auto js = nlohmann::json::object();
+    js["width"] = graph.width;
+    js["height"] = graph.height;
+    auto &nodes = js["nodes"] = nlohmann::json::array();
+    for (auto id : kept) {
+        auto &node = graph.nodes[id];
+        nodes.push_back({node.cell.x, node.cell.y, node.exits});
+    }
+    auto &segments = js["segments"] = nlohmann::json::array();
+    for (auto id : ids) {
+        auto &seg = graph.segments[id];
+        segments.push_back({number(seg.from), number(seg.to), seg.length});
+    }
+    auto fs = ofstream(filename);
+    if (!fs) throw runtime_error("cannot open filename " + filename);
+    fs << js << "\n";
 }
 
 
@@ -559,18 +1913,15 @@ int checkIncrocio(int matrix[], int x, int y, int n, int m, int dir) {
 //2 if 180 degree rotation
 //3 if 270 degree rotation
 //4 if this site is not near road
-int checkBuildingSite(int matrix[], int x, int y, int n, int m) {
-    vector<int> possibilities;
-    if (x + 1 < n && (matrix[(x + 1) * n + y] == 2 || matrix[(x + 1) * n + y] == 0)) possibilities.push_back(1);
-    if (x - 1 >= 0 && (matrix[(x - 1) * n + y] == 2 || matrix[(x - 1) * n + y] == 0)) return 0;
-    if (y + 1 < m && (matrix[x * n + y + 1] == 2 || matrix[x * n + y + 1] == 0)) possibilities.push_back(2);
-    if (y - 1 >= 0 && (matrix[x * n + y - 1] == 2 || matrix[x * n + y - 1] == 0)) return 3;
-
-    if (possibilities.size() == 0) return 4;
-
-    return possibilities.at(random(0, possibilities.size() - 1));
-
-
+int checkBuildingSite(const city_grid &grid, rng_pcg32 &rng, int x, int y) {
+    auto exits = grid.classes.exits(x, y);
+    if (exits & exit_nx) return 0;
+    if (exits & exit_ny) return 3;
+    //a road at +x gives 1 and one at +y gives 2, drawn at random when both are there
+    auto candidates = (exits & exit_px ? 1 : 0) + (exits & exit_py ? 1 : 0);
+    if (candidates == 0) return 4;
+    auto pick = random(rng, 0, candidates - 1);
+    return (exits & exit_px) && pick == 0 ? 1 : 2;
 }
 
 //this method returns only all the possibile rotations map
@@ -595,20 +1946,21 @@ vector<float> getRotations() {
     return pushed;
 };
 
-int createBuilding(int *matrix, int x, int y, int n, int m, int floors, int type, map<string, model *> modelsMap,
-                    scene *scn, map<int, float> rotations) {
+int createBuilding(const city_grid &grid, city_region &region, rng_pcg32 &rng, int x, int y, int floors, int type,
+                   const model_catalog &catalog, city_fragment *frag, const map<int, float> &rotations) {
+    trace_scope probe("createBuilding", true);
     int countX = 0, countYFinal = 0;
 
 
     if (floors >= 4) {
-        for (int xi = x; xi < n; xi++) {
-            if ((matrix[(xi) * n + y] == 2 || matrix[(xi) * n + y] == 0) || matrix[(xi) * n + y] == 6) break;
+        for (int xi = x; xi < region.x1; xi++) {
+            if (isRoad(grid.at(xi, y)) || region.isTaken(xi, y)) break;
 
-            if (xi == x && checkBuildingSite(matrix, xi, y, n, m) == 4) break;
+            if (xi == x && checkBuildingSite(grid, rng, xi, y) == 4) break;
             //cout << xi << " counted \n";
             int countY = 0;
-            for (int yi = y; yi < m; yi++) {
-                if ((matrix[xi * n + yi] == 2 || matrix[xi * n + yi] == 0) || matrix[xi * n + yi] == 6) break;
+            for (int yi = y; yi < region.y1; yi++) {
+                if (isRoad(grid.at(xi, yi)) || region.isTaken(xi, yi)) break;
                 //matrix[xi*n+yi] = 7;
                 countY++;
             }
@@ -625,11 +1977,17 @@ int createBuilding(int *matrix, int x, int y, int n, int m, int floors, int type
     }
     if (countX > 1 && countYFinal > 1) {
 
-        countX = random(2, min(3, countX));
-        countYFinal = random(2, min(3, countYFinal));
+        countX = random(rng, 2, min(3, countX));
+        countYFinal = random(rng, 2, min(3, countYFinal));
         if(floors < 6) type = 0;
-        int floorType = random(0, modelsMap["floor"]->possibilities.at(type).size() - 1);
+        int floorType = random(rng, 0, catalog[piece_floor].possibilities.at(type).size() - 1);
 
+        if (useProxy(frag, x, y, countX, countYFinal)) {
+            for (int xi = x; xi < x + countX; xi++)
+                for (int yi = y; yi < y + countYFinal; yi++) region.take(xi, yi);
+            add_proxy(frag, x, y, countX, countYFinal, floors + 1, "building" + to_string(x) + to_string(y));
+            return 0;
+        }
 
         for (int xi = x; xi < x + countX; xi++) {
             for (int yi = y; yi < y + countYFinal; yi++) {
@@ -637,37 +1995,37 @@ int createBuilding(int *matrix, int x, int y, int n, int m, int floors, int type
                 frame3f frame;
                 int roofType = 0;
                 int roofRotation = 0;
-                frame = rotateFrame(rotations[0], xi, yi);
+                frame = rotateFrame(rotations.at(0), xi, yi);
                 int tmpType = type;
 
 
                 if (xi == x + countX - 1 && yi == y + countYFinal - 1) {
                     roofRotation = type == 0 ? 2 : 0;
-                    frame = type == 0 ? frame : rotateFrame(rotations[1], xi, yi);
+                    frame = type == 0 ? frame : rotateFrame(rotations.at(1), xi, yi);
                 } else if (xi == x + countX - 1 && yi == y) {
                     roofRotation = type == 0 ? 3 : 0;
-                    frame = type == 0 ? frame : rotateFrame(rotations[2], xi, yi);
+                    frame = type == 0 ? frame : rotateFrame(rotations.at(2), xi, yi);
                 } else if (yi == y + countYFinal - 1 && xi == x) {
                     roofRotation = type == 0 ? 1 : 0;
-                    frame = type == 0 ? frame : rotateFrame(rotations[0], xi, yi);
+                    frame = type == 0 ? frame : rotateFrame(rotations.at(0), xi, yi);
                 } else if (xi == x + countX - 1) {
                     roofType = type == 0 ? 1 : 0;
                     roofRotation = type == 0 ? 3 : 0;
 
-                    frame = type == 0 ? rotateFrame(rotations[2], xi, yi) : rotateFrame(rotations[1], xi, yi);
+                    frame = type == 0 ? rotateFrame(rotations.at(2), xi, yi) : rotateFrame(rotations.at(1), xi, yi);
                     tmpType = 0;
 
                 } else if (yi == y + countYFinal - 1) {
                     roofType = type == 0 ? 1 : 0;
                     roofRotation = type == 0 ? 2 : 0;
 
-                    frame = rotateFrame(rotations[1], xi, yi);
+                    frame = rotateFrame(rotations.at(1), xi, yi);
                     tmpType = 0;
 
 
                 } else if (xi == x && yi == y) {
                     roofRotation = type == 0 ? 0 : 0;
-                    frame = type == 0 ? frame : rotateFrame(rotations[3], xi, yi);
+                    frame = type == 0 ? frame : rotateFrame(rotations.at(3), xi, yi);
 
                 } else if (xi == x) {
                     roofType = type == 0 ? 1 : 0;
@@ -678,7 +2036,7 @@ int createBuilding(int *matrix, int x, int y, int n, int m, int floors, int type
                     roofType = type == 0 ? 1 : 0;
                     roofRotation = type == 0 ? 0 : 0;
                     tmpType = 0;
-                    frame = rotateFrame(rotations[3], xi, yi);
+                    frame = rotateFrame(rotations.at(3), xi, yi);
 
                 } else {
                     roofType = type == 0 ? 2 : 0;
@@ -686,16 +2044,16 @@ int createBuilding(int *matrix, int x, int y, int n, int m, int floors, int type
                     tmpType = 0;
                 }
 
-                matrix[xi * n + yi] = 6;
+                region.take(xi, yi);
 
                 bool noBase = !(xi == x && yi == y);
                 if (xi == x && yi == y)
-                    frame = type == 0 ? rotateFrame(rotations[checkBuildingSite(matrix, xi, yi, n, m)], xi, yi) : frame;
+                    frame = type == 0 ? rotateFrame(rotations.at(checkBuildingSite(grid, rng, xi, yi)), xi, yi) : frame;
 
                 auto tmpFloors = noBase && tmpType == 0 ? floors + 1 : floors;
-                recursiveCreateBuilding(scn, tmpType, "building" + to_string(xi) + to_string(yi),
+                recursiveCreateBuilding(frag, rng, tmpType, "building" + to_string(xi) + to_string(yi),
                                         tmpType == 1 ? tmpFloors + 1 : tmpFloors, 0,
-                                        frame, vec3f{0, 0, 0}, modelsMap, type == 1 ? -2 : roofType, rotations,
+                                        frame, vec3f{0, 0, 0}, catalog, type == 1 ? -2 : roofType, rotations,
                                         roofRotation, xi, yi,
                                         noBase, floorType);
 
@@ -704,108 +2062,214 @@ int createBuilding(int *matrix, int x, int y, int n, int m, int floors, int type
 
     } else if( countX == 1 && countYFinal == 1 && floors <4){
 
-        auto rotationNeeded = checkBuildingSite(matrix, x, y, n, m);
+        auto rotationNeeded = checkBuildingSite(grid, rng, x, y);
         if (rotationNeeded == 4) return 0;
-        int floorType = random(0, modelsMap["floor"]->possibilities.at(type).size() - 1);
+        if (useProxy(frag, x, y, 1, 1)) {
+            add_proxy(frag, x, y, 1, 1, floors, "building" + to_string(x) + to_string(y));
+            return 0;
+        }
+        int floorType = random(rng, 0, catalog[piece_floor].possibilities.at(type).size() - 1);
 
-        recursiveCreateBuilding(scn, 0, "building" + to_string(x) + to_string(y), floors, 0,
-                                rotateFrame(rotations[rotationNeeded], x, y), vec3f{0, 0, 0},
-                                modelsMap, floorType);
+        recursiveCreateBuilding(frag, rng, 0, "building" + to_string(x) + to_string(y), floors, 0,
+                                rotateFrame(rotations.at(rotationNeeded), x, y), vec3f{0, 0, 0},
+                                catalog, floorType);
     }
 
+    return 0;
+}
+
+//Parameters of the generation, look at generate for their meaning
+struct city_params {
+    int citySize = 30;
+    int maxFloors = 5;
+    int minFloors = 1;
+    int streetSplitChance = 30;
+    int buildingCreationChance = 50;
+    int treeCreationChance = 30;
+    int urbanization = 75;
+    uint64_t seed = 0;
+    //merge the road tiles of every region or tile with batch_roads
+    bool batchRoads = false;
+    //buildings farther than this from the camera are boxes, 0 always uses the kit pieces
+    float lodDistance = 0;
+    //places the regions of a band on the global thread pool, off when the cities themselves run in parallel
+    bool parallelRegions = true;
+    //merges the pieces of every building in a few shapes with bake_building
+    bool bakeBuildings = false;
+    //file where generate saves the road graph as json, empty for none
+    string roadsFile;
+    //cells from (x,y) to (z,w) excluded whose roads are saved in roadsFile, empty to save the roads of the whole city
+    vec4i roadsArea = {0, 0, 0, 0};
+    //minimum distance in cells between the trees scattered by scatterTrees, 0 places up to three trees in a cell
+    float treeSpacing = 0;
+};
 
+//keeps the floors in the range the kit can build
+void clampFloors(city_params &params) {
+    params.maxFloors = max(params.maxFloors, 3);
+    params.minFloors = max(params.minFloors, 1);
+    params.minFloors = min(params.maxFloors, params.minFloors);
 }
 
-//This method will generate a city with:
-// citySize: matrix size
-// maxFloors: max number of floors of the  buildings of the city
-// minFloors: min number of floors of the  buildings of the city
-// streetSplitChance: the chance for street to fork look at method comment for more info
-// buildingCreationChance: the probability to create a buiding in each possible position (near roads) higher more buildings will be built
-// treeCreationChance: probability for trees to be placed in a position
-// urbanization: rappresents how much the city is urbanized(has higher buildings and less trees) it starts from the center of the matrix
-//               and will create urban enviroment until the urbanization percentage is ended so the borders will be more rural (lower buildings and more trees)
-void generate(scene *scn, int citySize, int maxFloors, int minFloors, int streetSplitChance, int buildingCreationChance,
-              int treeCreationChance, int urbanization) {
-    auto x = citySize;
-    auto y = citySize;
-    int matrixBuildings[x * y + 1];
-
-
-    maxFloors = max(maxFloors, 3);
-    minFloors = max(minFloors, 1);
-    minFloors = min(maxFloors, minFloors);
-    for (auto xi = 0; xi < x; xi++)
-        for (auto yi = 0; yi < y; yi++)
-            matrixBuildings[xi * x + yi] = 5;
-    cout << "[INFO] Generating roads\n";
-    generateRoads(matrixBuildings, x / 2, random(0, 0), x, y, 0, streetSplitChance, true, false);
-    cout << "[INFO] Roads generated, generation of buildings and trees started\n";
+//true for the cells out of the urbanized center of the city, where buildings are lower and trees more
+bool isRuralCell(const city_params &params, int xi, int yi) {
+    auto x = params.citySize, y = params.citySize;
+    auto urbanizationRate = 1.0f - params.urbanization / 100.0f;
+    return xi < x * urbanizationRate || xi > x - x * urbanizationRate ||
+           yi < y * urbanizationRate || yi > y - y * urbanizationRate;
+}
 
-    auto rotations = getRotationsMap();
-    auto urbanizationRate = 1.0f - urbanization / 100.0f;
-    auto modelsMap = loadModels();
+//Everything generate knows about a city kept in memory, so that a part of it can be generated again by regenerate
+struct city_layout {
+    city_params params;
+    city_grid grid;
+    model_catalog catalog;
+    map<int, float> rotations;
+    road_graph roads;
+    //rows of the instance table of the city placed by every cell, from first to last excluded, and, for the cells taken
+    //by a building of many cells, the cell that placed it
+    vector<pair<size_t, size_t>> placed;
+    vector<vec2i> owners;
+
+    size_t cell(int x, int y) const { return (size_t) x * grid.height + y; }
+};
 
-    for (auto xi = 0; xi < x; xi++) {
+//Scatters trees in the wooded cells of a region as a poisson disk set: no two trees are nearer than spacing. Bridson's
+//algorithm grows the set from a seed in every wooded cell, the candidates are checked against the trees near them with
+//a hash grid of cells of side spacing / sqrt(2), that hold at most one tree each, so a check reads 5x5 cells.
+//The square of side spacing around a tree must be in wooded cells of the region, which keeps the trees away from the
+//roads, the buildings and the other regions, so the regions and the tiles are scattered alone and in parallel.
+//The trees of urban cells are thinned to half, they are added grouped by cell for the layout
+void scatterTrees(city_fragment *frag, const city_region &region, const vector<bool> &wooded, const city_grid &grid,
+                  const model_catalog &catalog, const city_params &params, const function<bool(int, int)> &isRural) {
+    trace_scope probe("scatterTrees");
+    const auto seedTries = 4, candidateTries = 30;
+    auto spacing = params.treeSpacing, half = spacing / 2;
+    auto rng = cellRng(mixSeed(params.seed ^ treesStream), grid.origin.x + region.x0, grid.origin.y + region.y0);
+    auto isWooded = [&](int x, int y) {
+        return x >= region.x0 && x < region.x1 && y >= region.y0 && y < region.y1 &&
+               wooded[(size_t) (x - region.x0) * (region.y1 - region.y0) + (y - region.y0)] && !region.isTaken(x, y);
+    };
+
+    auto side = spacing / sqrt(2.0f);
+    auto hashX = (int) ceil((region.x1 - region.x0) / side), hashY = (int) ceil((region.y1 - region.y0) / side);
+    auto hash = vector<int>((size_t) hashX * hashY, -1);
+    auto hashCell = [&](const vec2f &p) {
+        return vec2i{min((int) ((p.x - region.x0) / side), hashX - 1), min((int) ((p.y - region.y0) / side), hashY - 1)};
+    };
+    auto trees = vector<vec2f>();
+    auto active = vector<int>();
+    auto accept = [&](const vec2f &p) {
+        for (auto x = (int) floor(p.x - half); x <= (int) floor(p.x + half); x++)
+            for (auto y = (int) floor(p.y - half); y <= (int) floor(p.y + half); y++)
+                if (!isWooded(x, y)) return false;
+        auto c = hashCell(p);
+        for (auto x = max(c.x - 2, 0); x <= min(c.x + 2, hashX - 1); x++)
+            for (auto y = max(c.y - 2, 0); y <= min(c.y + 2, hashY - 1); y++) {
+                auto tree = hash[(size_t) x * hashY + y];
+                if (tree >= 0 && dot(trees[tree] - p, trees[tree] - p) < spacing * spacing) return false;
+            }
+        hash[(size_t) c.x * hashY + c.y] = (int) trees.size();
+        active.push_back((int) trees.size());
+        trees.push_back(p);
+        return true;
+    };
+
+    for (auto xi = region.x0; xi < region.x1; xi++)
+        for (auto yi = region.y0; yi < region.y1; yi++) {
+            if (!isWooded(xi, yi)) continue;
+            for (auto i = 0; i < seedTries; i++)
+                if (accept(vec2f{(float) xi, (float) yi} + next_rand2f(rng))) break;
+            while (!active.empty()) {
+                auto p = trees[active.back()];
+                auto found = false;
+                for (auto i = 0; i < candidateTries && !found; i++) {
+                    auto angle = next_rand1f(rng, 0, 2 * pif);
+                    auto radius = next_rand1f(rng, spacing, 2 * spacing);
+                    found = accept(p + vec2f{cos(angle), sin(angle)} * radius);
+                }
+                if (!found) active.pop_back();
+            }
+        }
+
+    //the trunk of a kit tree is the center of its footprint, the tree is moved so the trunk is on the scattered point
+    auto &possibilities = catalog[piece_tree].possibilities.at(0);
+    auto trunks = vector<vec3f>();
+    for (auto id : possibilities) {
+        auto bounds = invalid_bbox3f;
+        for (auto *shp : frag->city->kitShapes[id])
+            for (auto &p : shp->pos) bounds += p;
+        trunks.push_back({(bounds.min.x + bounds.max.x) / 2, 0, (bounds.min.z + bounds.max.z) / 2});
+    }
+
+    auto cellOf = [](const vec2f &p) { return vec2i{(int) floor(p.x), (int) floor(p.y)}; };
+    sort(trees.begin(), trees.end(), [&](const vec2f &a, const vec2f &b) {
+        auto ca = cellOf(a), cb = cellOf(b);
+        return ca.x < cb.x || (ca.x == cb.x && ca.y < cb.y);
+    });
+    auto count = 0;
+    for (auto i = 0; i < trees.size(); i++) {
+        auto cell = cellOf(trees[i]);
+        auto first = frag->instances.size();
+        if (i == 0 || cell != cellOf(trees[i - 1])) count = 0;
+        if (!isRural(cell.x, cell.y) && random(rng, 0, 1) == 0) continue;
+        auto which = random(rng, 0, (int) possibilities.size() - 1);
+        auto frame = rotation_frame3f({0, 1, 0}, next_rand1f(rng, 0, 2 * pif));
+        frame.o = vec3f{trees[i].x, 0, trees[i].y - 1} - transform_vector(frame, trunks[which]);
+        add_obj(frag, possibilities[which], "tree" + to_string(cell.x) + to_string(cell.y) + to_string(count++), frame);
+        if (frag->cells.empty() || frag->cells.back().first != cell) frag->cells.push_back({cell, first});
+    }
+}
+
+//Places buildings, trees and road tiles in the cells of a region, isRural tells where buildings are lower and trees more
+//it only reads the grid and writes to its own region and fragment, so regions can be placed in parallel
+//roads is the road graph of the grid, when it is set the crossings are only looked for at its nodes
+void placeRegion(city_fragment *frag, city_region &region, const city_grid &grid, const road_graph *roads,
+                 const model_catalog &catalog, const map<int, float> &rotations, const city_params &params,
+                 const function<bool(int, int)> &isRural) {
+    trace_scope probe("placeRegion");
+    auto minFloors = params.minFloors;
+    auto maxFloors = params.maxFloors;
+    //cells left to the trees, when they are scattered
+    auto wooded = vector<bool>(params.treeSpacing > 0 ? region.taken.size() : 0, false);
+
+    for (auto xi = region.x0; xi < region.x1; xi++) {
         auto attraversamentoCount = 0;
-        for (auto yi = 0; yi < y; yi++) {
+        for (auto yi = region.y0; yi < region.y1; yi++) {
+            auto rng = cellRng(params.seed, grid.origin.x + xi, grid.origin.y + yi);
             auto frame = frame3f{{1, 0, 0}, {0, 1, 0}, {0, 0, 1},
                                  vec3f{0, 0, 1} * yi + vec3f{1, 0, 0} * xi};
-            auto dir = matrixBuildings[xi * x + yi];
-            if (dir == 6) continue;
-            if (dir == 5) {
-
-                if (random(0, 100) <= buildingCreationChance) {
-
-                    auto floors = xi < x * urbanizationRate || xi > x - x * urbanizationRate ||
-                                  yi < y * urbanizationRate || yi > y - y * urbanizationRate ? random(minFloors, minFloors <= 4 ? 4 : minFloors) : random( minFloors <= 2 ? 2 : minFloors, maxFloors);
-                    auto type = floors > 2 ? random(0, 1) : 0;
-                    createBuilding(matrixBuildings, xi, yi, x, y, floors, type, modelsMap, scn, rotations);
-
-                } else if (random(0, 100) <= treeCreationChance) {
-                    auto maxTrees =
-                            xi < x * urbanizationRate || xi > x - x * urbanizationRate || yi < y * urbanizationRate ||
-                            yi > y - y * urbanizationRate ? random(0, 2) : random(0, 1);
-                    auto count = 0;
-                    auto pushed = getRotations();
-                    while (count < maxTrees) {
-                        auto rotation = pushed.at(random(0, pushed.size() - 1));
-                        pushed.erase(std::remove(pushed.begin(), pushed.end(), rotation), pushed.end());
-                        add_obj(scn, modelsMap["tree"]->getRandomPossibility(),
-                                "tree" + to_string(xi) + to_string(yi) + to_string(count++),
-                                rotateFrame(rotation, xi, yi));
-                    }
-                }
-                /*
-                if (random(0, 100) <= buildingCreationChance) {
-                    auto rotationNeeded = checkBuildingSite(matrixBuildings, xi, yi, x, y);
-                    if (rotationNeeded == 4) continue;
+            auto dir = grid.at(xi, yi);
+            if (region.isTaken(xi, yi)) continue;
+            auto first = frag->instances.size();
+            region.placing = {xi, yi};
+            if (dir == cell_empty) {
+
+                if (random(rng, 0, 100) <= params.buildingCreationChance) {
+
+                    auto floors = isRural(xi, yi) ? random(rng, minFloors, minFloors <= 4 ? 4 : minFloors) : random(rng,  minFloors <= 2 ? 2 : minFloors, maxFloors);
+                    auto type = floors > 2 ? random(rng, 0, 1) : 0;
+                    createBuilding(grid, region, rng, xi, yi, floors, type, catalog, frag, rotations);
+                    if (params.bakeBuildings) bake_building(frag, first, xi, yi);
+
+                } else if (random(rng, 0, 100) <= params.treeCreationChance) {
+                    if (params.treeSpacing > 0)
+                        wooded[(size_t) (xi - region.x0) * (region.y1 - region.y0) + (yi - region.y0)] = true;
                     else {
-                        frame = rotateFrame(rotations[rotationNeeded], xi, yi);
-                        auto floors = xi < x * urbanizationRate || xi > x - x * urbanizationRate ||
-                                     yi < y * urbanizationRate || yi > y - y * urbanizationRate ? random(minFloors, minFloors <=2? 2 :minFloors) : random(
-                                minFloors <=3 ? 3 : minFloors, maxFloors);
-                        auto type = floors > 2 ? random(0, 1) : 0;
-                        recursiveCreateBuilding(scn, type, "building" + to_string(xi) + to_string(yi), floors, 0,
-                                                frame, vec3f{0, 0, 0}, modelsMap);
-                    }
-                } else if (random(0, 100) <= treeCreationChance) {
-                    auto maxTrees =
-                            xi < x * urbanizationRate || xi > x - x * urbanizationRate || yi < y * urbanizationRate ||
-                            yi > y - y * urbanizationRate ? random(0, 2) : random(0, 1);
-                    auto count = 0;
-                    auto pushed = getRotations();
-                    while (count < maxTrees) {
-                        auto rotation = pushed.at(random(0, pushed.size() - 1));
-                        pushed.erase(std::remove(pushed.begin(), pushed.end(), rotation), pushed.end());
-                        add_obj(scn, modelsMap["tree" ]->getRandomPossibility(),
-                                "tree" + to_string(xi) + to_string(yi) + to_string(count++),
-                                rotateFrame(rotation, xi, yi));
+                        auto maxTrees = isRural(xi, yi) ? random(rng, 0, 2) : random(rng, 0, 1);
+                        auto count = 0;
+                        auto pushed = getRotations();
+                        while (count < maxTrees) {
+                            auto rotation = pushed.at(random(rng, 0, pushed.size() - 1));
+                            pushed.erase(std::remove(pushed.begin(), pushed.end(), rotation), pushed.end());
+                            add_obj(frag, catalog[piece_tree].getRandomPossibility(rng),
+                                    "tree" + to_string(xi) + to_string(yi) + to_string(count++),
+                                    rotateFrame(rotation, xi, yi));
+                        }
                     }
                 }
-                 */
             } else {
-                if (dir == 2 || dir == 3) {
+                if (dir == cell_road_x) {
                     frame = rotation_frame3f({0, 1, 0}, 90.0f * pif / 180.0f);
                     frame.o = vec3f{0, 0, 1} * yi + vec3f{1, 0, 0} * xi;
                     frame.o += vec3f{1, 0, 0} * 1.0f;
@@ -814,28 +2278,348 @@ void generate(scene *scn, int citySize, int maxFloors, int minFloors, int street
                     frame.o += vec3f{1, 0, 0} * 1.0f;
                 frame.o += vec3f{0, 1, 0} * -0.2; //low the street model
 
-                auto incrocio = checkIncrocio(matrixBuildings, xi, yi, x, y, dir);
+                auto incrocio = !roads || roads->isNode(xi, yi) ? checkIncrocio(grid, xi, yi) : 0;
                 if (incrocio > 0) {
-                    add_obj(scn, modelsMap["crossing"]->possibilities.at(0).at(incrocio),
+                    add_obj(frag, catalog[piece_crossing].possibilities.at(0).at(incrocio),
                             "crossing" + to_string(xi) + to_string(yi), frame);
 
                 } else //put crosswalk
                 {
-                    if (random(0, 100) < 10 && dir == 0 && attraversamentoCount < 2) {
+                    if (random(rng, 0, 100) < 10 && dir == cell_road_y && attraversamentoCount < 2) {
                         attraversamentoCount++;
-                        add_obj(scn, modelsMap["road"]->possibilities.at(0).at(1),
+                        add_obj(frag, catalog[piece_road].possibilities.at(0).at(1),
                                 "road" + to_string(xi) + to_string(yi), frame);
                     } else
-                        add_obj(scn, modelsMap["road"]->possibilities.at(0).at(0),
+                        add_obj(frag, catalog[piece_road].possibilities.at(0).at(0),
                                 "road" + to_string(xi) + to_string(yi),
                                 frame);
                 }
             }
+            if (frag->instances.size() > first) frag->cells.push_back({{xi, yi}, first});
         }
     }
-    cout << "[INFO] Buildings and trees generated\n";
+    if (params.treeSpacing > 0) scatterTrees(frag, region, wooded, grid, catalog, params, isRural);
+}
+
+//Remembers in the layout the rows placed by every cell of the region and the buildings that took its cells
+//base is the row of the table of the city where the rows of the fragment are going to be appended
+void record_region(city_layout *layout, const city_fragment &frag, const city_region &region, size_t base) {
+    for (auto i = 0; i < frag.cells.size(); i++) {
+        auto cell = frag.cells[i].first;
+        auto last = i + 1 < frag.cells.size() ? frag.cells[i + 1].second : frag.instances.size();
+        layout->placed[layout->cell(cell.x, cell.y)] = {base + frag.cells[i].second, base + last};
+    }
+    for (auto xi = region.x0; xi < region.x1; xi++)
+        for (auto yi = region.y0; yi < region.y1; yi++)
+            if (region.isTaken(xi, yi)) layout->owners[layout->cell(xi, yi)] = region.owner(xi, yi);
+}
+
+//Places the cells from (x0,y0) to (x1,y1) excluded and emits their instances, when layout is set it also remembers
+//which cell placed every instance
+//the regions of a band along y are placed in parallel, each one in its own fragment, and the band is emitted
+//before the next one is placed, so a streamed city only keeps a band in memory
+void placeCells(city_scene *city, city_layout *layout, city_grid &grid, const road_graph &roads,
+                const model_catalog &catalog, const map<int, float> &rotations, const city_params &params, int x0,
+                int y0, int x1, int y1) {
+    auto isRural = [&](int xi, int yi) { return isRuralCell(params, xi, yi); };
+    for (auto rx = x0; rx < x1; rx += regionSize) {
+        vector<city_region> regions;
+        for (auto ry = y0; ry < y1; ry += regionSize)
+            regions.push_back(city_region(rx, ry, min(rx + regionSize, x1), min(ry + regionSize, y1)));
+        auto fragments = vector<city_fragment>(regions.size());
+        auto place = [&](int idx) {
+            fragments[idx].city = city;
+            placeRegion(&fragments[idx], regions[idx], grid, &roads, catalog, rotations, params, isRural);
+        };
+        if (params.parallelRegions) parallel_for((int) regions.size(), place);
+        else for (auto idx = 0; idx < regions.size(); idx++) place(idx);
+
+        //fragments are merged in region order so the scene is the same whatever the number of threads
+        for (auto idx = 0; idx < regions.size(); idx++) {
+            auto &region = regions[idx];
+            auto &instances = fragments[idx].instances;
+            if (layout) record_region(layout, fragments[idx], region, city->instances.size());
+            auto batched = params.batchRoads ? batch_roads(city, instances, to_string(region.x0) + "_" + to_string(region.y0))
+                                             : vector<shape *>();
+            batched.insert(batched.end(), fragments[idx].shapes.begin(), fragments[idx].shapes.end());
+            emit_instances(city, instances, batched);
+            for (auto xi = region.x0; xi < region.x1; xi++)
+                for (auto yi = region.y0; yi < region.y1; yi++)
+                    if (region.isTaken(xi, yi)) grid.at(xi, yi) = cell_building;
+        }
+    }
+}
+
+//This method will generate a city with:
+// citySize: matrix size
+// maxFloors: max number of floors of the  buildings of the city
+// minFloors: min number of floors of the  buildings of the city
+// streetSplitChance: the chance for street to fork look at method comment for more info
+// buildingCreationChance: the probability to create a buiding in each possible position (near roads) higher more buildings will be built
+// treeCreationChance: probability for trees to be placed in a position
+// urbanization: rappresents how much the city is urbanized(has higher buildings and less trees) it starts from the center of the matrix
+//               and will create urban enviroment until the urbanization percentage is ended so the borders will be more rural (lower buildings and more trees)
+// seed: seed of the random streams, the same seed and parameters always generate the same city
+//all of them are in params
+//when layout is set the city is kept in it for regenerate, the road tiles are not batched and the unused kit shapes
+//stay in the scene, the caller removes them with remove_unused_shapes after the last edit
+void generate(city_scene *city, city_params params, city_layout *layout = nullptr) {
+    trace_scope probe("generate");
+    auto x = params.citySize;
+    auto y = params.citySize;
+    auto cityGrid = city_grid();
+    auto &grid = layout ? layout->grid : cityGrid;
+    grid = city_grid(x, y);
+
+
+    clampFloors(params);
+    log_line() << "[INFO] Generating roads\n";
+    auto roadsTimer = timer();
+    auto roadsRng = streamRng(params.seed, roadsStream);
+    generateRoads(grid, roadsRng, x / 2, 0, 0, params.streetSplitChance, true, false);
+    classifyCells(grid);
+    auto cityRoads = road_graph();
+    auto &roads = layout ? layout->roads : cityRoads;
+    roads = buildRoadGraph(grid);
+    city->stats.roadsTime += roadsTimer.elapsed();
+    log_line() << "[INFO] Road graph with " << roads.nodes.size() << " nodes and " << roads.segments.size()
+               << " segments\n";
+    if (!params.roadsFile.empty()) saveRoadGraph(params.roadsFile, roads, params.roadsArea);
+    log_line() << "[INFO] Roads generated, generation of buildings and trees started\n";
+
+    auto kitTimer = timer();
+    trace_scope kitProbe("kit");
+    auto rotations = getRotationsMap();
+    auto catalog = loadModels();
+    add_kit(city, catalog);
+    if (params.lodDistance > 0) add_proxies(city, params.lodDistance, params.maxFloors + 2);
+    kitProbe.end();
+    city->stats.kitTime += kitTimer.elapsed();
+
+    if (layout) {
+        params.batchRoads = false;
+        layout->placed.assign((size_t) x * y, {0, 0});
+        layout->owners.assign((size_t) x * y, {-1, -1});
+    }
+
+    //the time spent writing the streamed instances is not part of the placement
+    auto placementTimer = timer();
+    auto saveTime = city->stats.saveTime;
+    placeCells(city, layout, grid, roads, catalog, rotations, params, 0, 0, x, y);
+    if (layout) {
+        layout->params = params;
+        layout->catalog = move(catalog);
+        layout->rotations = move(rotations);
+    } else
+        remove_unused_shapes(city);
+    city->stats.placementTime += placementTimer.elapsed() - (city->stats.saveTime - saveTime);
+    log_line() << "[INFO] Buildings and trees generated\n";
+
+
+}
+
+//Generates again the buildings, trees and road tiles of the cells from (x0,y0) to (x1,y1) excluded with the floors,
+//chances and urbanization of params, the seed and the size stay the ones of the city.
+//The rectangle grows to the buildings that cross its border and only its instances are removed and placed again, the
+//roads are kept so the road tiles placed again still join the ones around the rectangle
+void regenerate(city_scene *city, city_layout *layout, int x0, int y0, int x1, int y1, city_params params) {
+    trace_scope probe("regenerate");
+    auto &grid = layout->grid;
+    params.seed = layout->params.seed;
+    params.citySize = layout->params.citySize;
+    params.lodDistance = layout->params.lodDistance;
+    params.batchRoads = false;
+    clampFloors(params);
+    x0 = max(x0, 0), y0 = max(y0, 0), x1 = min(x1, grid.width), y1 = min(y1, grid.height);
+    if (x0 >= x1 || y0 >= y1) return;
+
+    //buildings are at most 3 cells wide, so the ones crossing the border take a cell at most 2 cells out of it
+    auto inside = [&](int xi, int yi) { return xi >= x0 && xi < x1 && yi >= y0 && yi < y1; };
+    for (auto grown = true; grown;) {
+        grown = false;
+        for (auto xi = max(x0 - 2, 0); xi < min(x1 + 2, grid.width); xi++)
+            for (auto yi = max(y0 - 2, 0); yi < min(y1 + 2, grid.height); yi++) {
+                auto owner = layout->owners[layout->cell(xi, yi)];
+                if (owner.x < 0 || inside(xi, yi) == inside(owner.x, owner.y)) continue;
+                x0 = min({x0, xi, owner.x}), y0 = min({y0, yi, owner.y});
+                x1 = max({x1, xi + 1, owner.x + 1}), y1 = max({y1, yi + 1, owner.y + 1});
+                grown = true;
+            }
+    }
+
+    //the rows of the removed instances are left in the table without shape, the ones placed again are appended
+    auto &rows = city->instances;
+    for (auto xi = x0; xi < x1; xi++)
+        for (auto yi = y0; yi < y1; yi++) {
+            auto &placed = layout->placed[layout->cell(xi, yi)];
+            for (auto row = placed.first; row < placed.second; row++) {
+                auto *shp = rows.shapes[row];
+                city->stats.instances--;
+                city->stats.triangles -= shp->triangles.size() + 2 * shp->quads.size();
+                rows.shapes[row] = nullptr;
+            }
+            placed = {0, 0};
+            layout->owners[layout->cell(xi, yi)] = {-1, -1};
+            if (grid.at(xi, yi) == cell_building) grid.at(xi, yi) = cell_empty;
+        }
+
+    placeCells(city, layout, grid, layout->roads, layout->catalog, layout->rotations, params, x0, y0, x1, y1);
+}
+
+
+//The infinite city is made of square tiles of tileCells cells, the tile (tx,ty) covers the cells from
+//(tx * tileCells, ty * tileCells) and any tile can be generated alone from the seed, in any order.
+//Every column of tiles is crossed along y by an avenue and every row of tiles along x, the avenues only depend on
+//the seed and the column (or row) so they are continuous between tiles. The local streets stay inside the tile
+//and never touch its border, so the cells near the border of a tile only depend on the avenues.
+enum tile_stream : uint64_t { tile_avenue_y = 0, tile_avenue_x = 1, tile_streets = 2, tile_rural = 3 };
+
+rng_pcg32 tileRng(uint64_t seed, uint64_t kind, int tx, int ty) {
+    return streamRng(mixSeed(seed ^ mixSeed(kind + 1)), ((uint64_t) (uint32_t) tx << 32) | (uint32_t) ty);
+}
+
+//offset in the tile of the avenue of a column (kind tile_avenue_y) or of a row (kind tile_avenue_x) of tiles
+int avenueOffset(uint64_t seed, uint64_t kind, int t, int tileCells) {
+    auto rng = tileRng(seed, kind, t, 0);
+    return random(rng, 3, tileCells - 4);
+}
+
+struct city_tile {
+    int tx = 0, ty = 0;
+    //the grid has a border of one cell around the tile, filled with the avenues of the tile, so roads at the border
+    //of the tile are classified as the neighbour tiles see them
+    city_grid grid;
+    instance_table instances;
+    //shapes made only for this tile by bake_building
+    vector<shape *> shapes;
+
+    ~city_tile() {
+        for (auto *shp : shapes) delete shp;
+    }
+};
+
+//Working set of the generated tiles, at most maxTiles are kept and the least recently used is evicted
+//evicted tiles are generated again when they are asked, the same seed always gives the same tile
+struct city_tiles {
+    const city_scene *city = nullptr;
+    city_params params;
+    model_catalog catalog;
+    map<int, float> rotations;
+    int tileCells = 64;
+    size_t maxTiles = 16;
+    map<pair<int, int>, unique_ptr<city_tile>> tiles;
+    list<pair<int, int>> lru;
+
+    city_tiles(city_scene *city, const city_params &params, int tileCells, size_t maxTiles)
+            : city(city), params(params), tileCells(max(tileCells, 12)), maxTiles(max(maxTiles, (size_t) 1)) {
+        clampFloors(this->params);
+        rotations = getRotationsMap();
+        catalog = loadModels();
+        add_kit(city, catalog);
+        if (this->params.lodDistance > 0) add_proxies(city, this->params.lodDistance, this->params.maxFloors + 2);
+    }
+};
 
+//adds the local streets of one block of the tile, the block is the rectangle [x0,x1)x[y0,y1) of the tile grid
+//the streets are walked in a copy of the block with a border of one cell, so they see the avenues next to the block
+//but only the cells inside the block are copied back
+void generateBlockRoads(city_grid &grid, rng_pcg32 &rng, int x0, int y0, int x1, int y1, int forkChance,
+                        int startX, int dirX, int startY, int dirY) {
+    if (x1 <= x0 || y1 <= y0) return;
+    auto block = city_grid(x1 - x0 + 2, y1 - y0 + 2);
+    for (auto xi = 0; xi < block.width; xi++)
+        for (auto yi = 0; yi < block.height; yi++) block.at(xi, yi) = grid.at(x0 - 1 + xi, y0 - 1 + yi);
+
+    //one street along x leaves the avenue along y and one along y leaves the avenue along x
+    generateRoads(block, rng, startX - x0 + 1, random(rng, 1, block.height - 2), dirX, forkChance, false, false);
+    generateRoads(block, rng, random(rng, 1, block.width - 2), startY - y0 + 1, dirY, forkChance, false, false);
+
+    for (auto xi = x0; xi < x1; xi++)
+        for (auto yi = y0; yi < y1; yi++) grid.at(xi, yi) = block.at(xi - x0 + 1, yi - y0 + 1);
+}
 
+unique_ptr<city_tile> make_tile(const city_tiles *tiles, int tx, int ty) {
+    trace_scope probe("make_tile");
+    auto &params = tiles->params;
+    auto size = tiles->tileCells;
+    auto tile = unique_ptr<city_tile>(new city_tile());
+    tile->tx = tx;
+    tile->ty = ty;
+    tile->grid = city_grid(size + 2, size + 2);
+    auto &grid = tile->grid;
+    grid.origin = {tx * size - 1, ty * size - 1};
+
+    //avenues, in grid coordinates, they cross the border too
+    auto ax = avenueOffset(params.seed, tile_avenue_y, tx, size) + 1;
+    auto ay = avenueOffset(params.seed, tile_avenue_x, ty, size) + 1;
+    for (auto yi = 0; yi < grid.height; yi++) grid.at(ax, yi) = cell_road_y;
+    for (auto xi = 0; xi < grid.width; xi++)
+        if (xi != ax) grid.at(xi, ay) = cell_road_x;
+
+    //local streets in the four blocks between the avenues, the border of the tile (grid cells 1 and size) is left free
+    auto rng = tileRng(params.seed, tile_streets, tx, ty);
+    auto forkChance = params.streetSplitChance;
+    generateBlockRoads(grid, rng, 2, 2, ax, ay, forkChance, ax - 1, 3, ay - 1, 1);
+    generateBlockRoads(grid, rng, ax + 1, 2, size, ay, forkChance, ax + 1, 2, ay - 1, 1);
+    generateBlockRoads(grid, rng, 2, ay + 1, ax, size, forkChance, ax - 1, 3, ay + 1, 0);
+    generateBlockRoads(grid, rng, ax + 1, ay + 1, size, size, forkChance, ax + 1, 2, ay + 1, 0);
+    classifyCells(grid);
+
+    //the whole tile is either urban or rural
+    auto ruralRng = tileRng(params.seed, tile_rural, tx, ty);
+    auto rural = random(ruralRng, 1, 100) > params.urbanization;
+    auto isRural = [rural](int, int) { return rural; };
+
+    auto region = city_region(1, 1, size + 1, size + 1);
+    auto frag = city_fragment();
+    frag.city = tiles->city;
+    frag.offset = vec3f{(float) grid.origin.x, 0, (float) grid.origin.y};
+    frag.prefix = "t" + to_string(tx) + "_" + to_string(ty) + "_";
+    placeRegion(&frag, region, grid, nullptr, tiles->catalog, tiles->rotations, params, isRural);
+    for (auto xi = region.x0; xi < region.x1; xi++)
+        for (auto yi = region.y0; yi < region.y1; yi++)
+            if (region.isTaken(xi, yi)) grid.at(xi, yi) = cell_building;
+    tile->instances = move(frag.instances);
+    tile->shapes = move(frag.shapes);
+    return tile;
+}
+
+//Returns the tile (tx,ty) generating it if it is not in the working set, the returned tile stays valid until
+//maxTiles other tiles are asked
+city_tile *get_tile(city_tiles *tiles, int tx, int ty) {
+    auto key = make_pair(tx, ty);
+    auto it = tiles->tiles.find(key);
+    if (it != tiles->tiles.end()) {
+        tiles->lru.remove(key);
+        tiles->lru.push_front(key);
+        return it->second.get();
+    }
+    while (tiles->tiles.size() >= tiles->maxTiles) {
+        tiles->tiles.erase(tiles->lru.back());
+        tiles->lru.pop_back();
+    }
+    auto *tile = (tiles->tiles[key] = make_tile(tiles, tx, ty)).get();
+    tiles->lru.push_front(key);
+    return tile;
+}
+
+//Emits the instances of the tiles from (tx0,ty0) to (tx1,ty1) excluded, it is the same city
+//whatever the order and the size of the working set, the tiles are removed from the working set
+void generateTiles(city_tiles *tiles, city_scene *city, int tx0, int ty0, int tx1, int ty1) {
+    for (auto tx = tx0; tx < tx1; tx++) {
+        for (auto ty = ty0; ty < ty1; ty++) {
+            auto *tile = get_tile(tiles, tx, ty);
+            auto batched = tiles->params.batchRoads
+                           ? batch_roads(city, tile->instances, "t" + to_string(tx) + "_" + to_string(ty))
+                           : vector<shape *>();
+            batched.insert(batched.end(), tile->shapes.begin(), tile->shapes.end());
+            tile->shapes.clear();
+            emit_instances(city, tile->instances, batched);
+            tiles->tiles.erase(make_pair(tx, ty));
+            tiles->lru.remove(make_pair(tx, ty));
+        }
+        log_line() << "[INFO] Column of tiles " << tx << " generated\n";
+    }
 }
 
 
@@ -898,7 +2682,404 @@ void initScene(scene *scn, bool sunset) {
     scn->cameras.push_back(cam);
 }
 
-int main(int argc, char **argv) {
+//Settings of the image rendered when the output filename is an image
+struct city_render {
+    int resolution = 540;
+    int samples = 64;
+};
+
+bool isImageFile(const string &filename) {
+    auto extension = path_extension(filename);
+    for (auto image : {".png", ".jpg", ".bmp", ".tga", ".hdr", ".exr"})
+        if (extension == image) return true;
+    return false;
+}
+
+//Renders the scene from memory with the path tracer of yocto from its first camera and saves only the image,
+//without writing the scene and loading it back
+void renderScene(const string &filename, scene *scn, const city_render &render) {
+    trace_scope probe("render");
+    //the sun is a point and needs a radius, the kit has no textures so no tangent space is needed
+    auto opts = add_elements_options::none();
+    opts.smooth_normals = true;
+    opts.pointline_radius = 0.001f;
+    add_elements(scn, opts);
+    build_bvh(scn);
+    update_lights(scn, true, true);
+
+    auto params = trace_params();
+    params.height = render.resolution;
+    params.width = (int) round(scn->cameras[0]->aspect * render.resolution);
+    params.nsamples = render.samples;
+    auto img = trace_image(scn, params);
+    if (!save_image(filename, img, 0, 2.2f)) throw runtime_error("cannot save image " + filename);
+}
+
+//Rectangle of the grid generated again with other parameters once the city is done, look at regenerate
+struct city_edit {
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    city_params params;
+};
+
+//Generates a city and saves it in outputFile, tiles > 0 generates the tiles of the infinite city instead
+//the edits are applied in order to the generated city, which is kept in memory to do them
+//when outputFile is an image the city is rendered in memory and only the image is saved
+city_stats runCity(const city_params &params, bool sunset, const string &outputFile, int tiles, int tileSize,
+                   const vector<city_edit> &edits = {}, const city_render &render = {}) {
+    //the scene and the writer are released even when the generation throws, the daemon goes on after a failed job
+    auto owned = unique_ptr<scene>(new scene());
+    auto *scn = owned.get();
+
+    initScene(scn, sunset);
+
+    city_scene city{scn};
+
+    //obj scenes are written while they are generated, the other formats need the whole scene
+    if (path_extension(outputFile) == ".obj" && edits.empty()) {
+        city.writer = make_writer(outputFile);
+        for (auto *cam : scn->cameras) write_camera(city.writer.get(), cam);
+        auto sceneRows = instance_table();
+        for (auto *ist : scn->instances) sceneRows.add(ist->frame, ist->shp, sceneRows.addName(ist->name));
+        emit_instances(&city, sceneRows);
+        for (auto *ist : scn->instances) delete ist;
+        scn->instances.clear();
+    }
+
+    if (tiles > 0) {
+        auto cityTiles = city_tiles(&city, params, tileSize, (size_t) tiles);
+        generateTiles(&cityTiles, &city, 0, 0, tiles, tiles);
+        remove_unused_shapes(&city);
+    } else if (!edits.empty()) {
+        auto layout = city_layout();
+        generate(&city, params, &layout);
+        for (auto &edit : edits) {
+            auto editTimer = timer();
+            regenerate(&city, &layout, edit.x0, edit.y0, edit.x1, edit.y1, edit.params);
+            log_line() << "[INFO] Region regenerated in " << editTimer.elapsed() << "s\n";
+        }
+        remove_unused_shapes(&city);
+    } else
+        generate(&city, params);
+
+    if (isImageFile(outputFile)) {
+        log_line() << "[INFO] Rendering image\n";
+        auto renderTimer = timer();
+        add_instances(scn, city.instances);
+        renderScene(outputFile, scn, render);
+        city.stats.renderTime += renderTimer.elapsed();
+        log_line() << "[INFO] Image saved\n";
+    } else {
+        log_line() << "[INFO] Saving scene\n";
+
+        auto saveTimer = timer();
+        {
+            trace_scope probe("save");
+            if (city.writer) close_writer(city.writer.get());
+            else saveScene(outputFile, scn, city.instances);
+        }
+        city.stats.saveTime += saveTimer.elapsed();
+
+        log_line() << "[INFO] Scne saved\n";
+    }
+
+    return city.stats;
+}
+
+//peak resident memory in KB since the last reset, on linux the peak can be reset between the runs of the benchmark
+#ifdef __linux__
+void resetPeakMemory() {
+    ofstream("/proc/self/clear_refs") << "5";
+}
+
+size_t peakMemory() {
+    auto status = ifstream("/proc/self/status");
+    string line;
+    while (getline(status, line))
+        if (line.compare(0, 6, "VmHWM:") == 0) return (size_t) atoll(line.c_str() + 6);
+    return 0;
+}
+#else
+void resetPeakMemory() {}
+
+size_t peakMemory() {
+#ifndef _WIN32
+    auto usage = rusage();
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return (size_t) usage.ru_maxrss / 1024;
+#else
+    return (size_t) usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+#endif
+
+//Generates a matrix of cities with fixed seeds and writes the time of each phase and the size of the cities in a json
+//report, the sizes go up to maxSize and every size is generated with the default parameters and with more forks,
+//less buildings and less urbanization
+void runBenchmark(const string &reportFile, const string &outputFile, int maxSize, uint64_t seed) {
+    struct bench_case {
+        string name;
+        int streetSplitChance, buildingCreationChance, urbanization;
+    };
+    auto cases = vector<bench_case>{{"default", 30, 50, 75},
+                                    {"forks",   60, 50, 75},
+                                    {"sparse",  30, 20, 75},
+                                    {"rural",   30, 50, 25}};
+    auto sizes = vector<int>{30, 125, 500, 1000, 2000};
+
+    //the report is written again after every run, so the runs already done are kept if the benchmark is stopped
+    auto report = nlohmann::json::object();
+    report["seed"] = seed;
+    report["output"] = outputFile;
+    auto &runs = report["runs"] = nlohmann::json::array();
+    auto save = [&]() {
+        auto fs = ofstream(reportFile);
+        if (!fs) throw runtime_error("cannot open filename " + reportFile);
+        fs << report.dump(2) << "\n";
+    };
+    save();
+    for (auto size : sizes) {
+        if (size > maxSize) continue;
+        for (auto &bench : cases) {
+            auto params = city_params();
+            params.citySize = size;
+            params.streetSplitChance = bench.streetSplitChance;
+            params.buildingCreationChance = bench.buildingCreationChance;
+            params.urbanization = bench.urbanization;
+            params.seed = seed;
+
+            log_line() << "[BENCH] size " << size << " " << bench.name << "\n";
+            resetPeakMemory();
+            auto totalTimer = timer();
+            auto stats = runCity(params, false, outputFile, 0, 0);
+            auto total = totalTimer.elapsed();
+
+            auto run = nlohmann::json::object();
+            run["size"] = size;
+            run["case"] = bench.name;
+            run["street_split"] = params.streetSplitChance;
+            run["building_creation"] = params.buildingCreationChance;
+            run["urbanization"] = params.urbanization;
+            run["roads_s"] = stats.roadsTime;
+            run["kit_s"] = stats.kitTime;
+            run["placement_s"] = stats.placementTime;
+            run["save_s"] = stats.saveTime;
+            run["total_s"] = total;
+            run["instances"] = stats.instances;
+            run["triangles"] = stats.triangles;
+            run["peak_rss_kb"] = peakMemory();
+            runs.push_back(run);
+            save();
+        }
+    }
+    log_line() << "[BENCH] Report saved in " << reportFile << "\n";
+}
+
+//Setters of the generation parameters by the name of their field, used by the batch files and the jobs of the daemon
+const map<string, function<void(city_params &, long long)>> &paramSetters() {
+    static auto setters = map<string, function<void(city_params &, long long)>>{
+            {"citySize",               [](city_params &p, long long v) { p.citySize = (int) v; }},
+            {"minFloors",              [](city_params &p, long long v) { p.minFloors = (int) v; }},
+            {"maxFloors",              [](city_params &p, long long v) { p.maxFloors = (int) v; }},
+            {"streetSplitChance",      [](city_params &p, long long v) { p.streetSplitChance = (int) v; }},
+            {"buildingCreationChance", [](city_params &p, long long v) { p.buildingCreationChance = (int) v; }},
+            {"treeCreationChance",     [](city_params &p, long long v) { p.treeCreationChance = (int) v; }},
+            {"urbanization",           [](city_params &p, long long v) { p.urbanization = (int) v; }},
+            {"seed",                   [](city_params &p, long long v) { p.seed = (uint64_t) v; }}};
+    return setters;
+}
+
+//City of a batch and the file where it is saved
+struct city_job {
+    city_params params;
+    string output;
+};
+
+//Reads the cities of a batch file, every line is a sweep of key=value pairs where the keys are the names of the
+//fields of city_params and the values are lists of numbers or ranges like 1,5,10..20; the line generates a city for
+//every combination of its values. The output key is the filename of the cities, where {key} is replaced by the value of
+//key and {n} by the number of the city, empty lines and lines starting with # are skipped
+vector<city_job> readBatch(const string &filename) {
+    auto &setters = paramSetters();
+    auto file = ifstream(filename);
+    if (!file) throw runtime_error("cannot open batch " + filename);
+    auto jobs = vector<city_job>();
+    string line;
+    while (getline(file, line)) {
+        auto tokens = istringstream(line);
+        auto output = "city_{n}.obj"s;
+        //combinations of the values read so far, with the values of every key for the output filename
+        auto sweep = vector<pair<city_params, map<string, string>>>{{city_params(), {}}};
+        string token;
+        while (tokens >> token) {
+            if (token[0] == '#') break;
+            auto equal = token.find('=');
+            if (equal == string::npos) throw runtime_error("invalid batch entry " + token);
+            auto key = token.substr(0, equal), value = token.substr(equal + 1);
+            if (key == "output") {
+                output = value;
+                continue;
+            }
+            if (!setters.count(key)) throw runtime_error("unknown batch key " + key);
+
+            auto values = vector<long long>();
+            auto items = istringstream(value);
+            string item;
+            while (getline(items, item, ',')) {
+                auto range = item.find("..");
+                auto first = stoll(item.substr(0, range));
+                auto last = range == string::npos ? first : stoll(item.substr(range + 2));
+                for (auto v = first; v <= last; v++) values.push_back(v);
+            }
+
+            auto combined = decltype(sweep)();
+            for (auto &job : sweep)
+                for (auto v : values) {
+                    combined.push_back(job);
+                    setters.at(key)(combined.back().first, v);
+                    combined.back().second[key] = to_string(v);
+                }
+            sweep = move(combined);
+        }
+        if (sweep.front().second.empty() && output == "city_{n}.obj") continue;
+
+        for (auto &job : sweep) {
+            job.second["n"] = to_string(jobs.size());
+            auto name = output;
+            for (auto &value : job.second) {
+                auto pattern = "{" + value.first + "}";
+                for (auto pos = name.find(pattern); pos != string::npos; pos = name.find(pattern))
+                    name.replace(pos, pattern.size(), value.second);
+            }
+            jobs.push_back({job.first, name});
+        }
+    }
+    return jobs;
+}
+
+//Generates all the cities of a batch file, threads cities at a time on a thread pool, the kit models are parsed once
+//and shared by all of them and each city places its regions alone on its thread
+void runBatch(const string &batchFile, int threads, bool sunset) {
+    auto jobs = readBatch(batchFile);
+    log_line() << "[INFO] Generating " << jobs.size() << " cities\n";
+    auto batchTimer = timer();
+    auto *pool = threads > 0 ? make_pool(threads) : make_pool();
+    auto done = 0;
+    mutex doneMutex;
+    for (auto &job : jobs) {
+        run_async(pool, [&]() {
+            auto params = job.params;
+            params.parallelRegions = false;
+            auto jobTimer = timer();
+            auto stats = runCity(params, sunset, job.output, 0, 0);
+            lock_guard<mutex> lock(doneMutex);
+            log_line() << "[INFO] City " << ++done << "/" << jobs.size() << " saved in " << job.output << " ("
+                       << stats.instances << " instances, " << jobTimer.elapsed() << "s)\n";
+        });
+    }
+    wait_pool(pool);
+    delete pool;
+    auto elapsed = batchTimer.elapsed();
+    log_line() << "[INFO] Batch of " << jobs.size() << " cities generated in " << elapsed << "s, "
+               << (elapsed > 0 ? jobs.size() * 3600 / elapsed : 0) << " cities per hour\n";
+}
+
+//Generates the city of a job of the daemon, a json object with the generation parameters by the name of their field,
+//the output filename, sunset, the resolution and samples of an image output and an optional id, and returns the json
+//reply with the output and the time of each phase
+string serveJob(const string &line, bool sunset) {
+    auto reply = nlohmann::json::object();
+    try {
+        auto job = nlohmann::json::parse(line);
+        if (job.count("id")) reply["id"] = job["id"];
+        auto params = city_params();
+        auto render = city_render();
+        auto output = "scene_out.obj"s;
+        for (auto it = job.begin(); it != job.end(); ++it) {
+            if (it.key() == "id") continue;
+            else if (it.key() == "output") output = it.value().get<string>();
+            else if (it.key() == "sunset") sunset = it.value().get<bool>();
+            else if (it.key() == "resolution") render.resolution = it.value().get<int>();
+            else if (it.key() == "samples") render.samples = it.value().get<int>();
+            else if (paramSetters().count(it.key())) paramSetters().at(it.key())(params, it.value().get<long long>());
+            else throw runtime_error("unknown job key " + it.key());
+        }
+
+        auto totalTimer = timer();
+        auto stats = runCity(params, sunset, output, 0, 0, {}, render);
+        reply["output"] = output;
+        reply["instances"] = stats.instances;
+        reply["triangles"] = stats.triangles;
+        reply["roads_s"] = stats.roadsTime;
+        reply["kit_s"] = stats.kitTime;
+        reply["placement_s"] = stats.placementTime;
+        reply["save_s"] = stats.saveTime;
+        reply["render_s"] = stats.renderTime;
+        reply["total_s"] = totalTimer.elapsed();
+    } catch (const exception &e) {
+        reply["error"] = e.what();
+    }
+    return reply.dump();
+}
+
+//Serves the jobs read as json lines from stdin or, when socketPath is set, from the clients of a unix socket one client
+//at a time, every job gets a json line back. The parsed kit models and the thread pool stay loaded between the jobs
+void runServer(const string &socketPath, bool sunset) {
+    if (socketPath.empty()) {
+        //the replies are the only lines on stdout, the log goes to stderr
+        auto *stdoutBuffer = cout.rdbuf(cerr.rdbuf());
+        ostream replies(stdoutBuffer);
+        string line;
+        while (getline(cin, line))
+            if (!line.empty()) replies << serveJob(line, sunset) << endl;
+        cout.rdbuf(stdoutBuffer);
+        return;
+    }
+
+#ifndef _WIN32
+    auto address = sockaddr_un();
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) throw runtime_error("socket path too long " + socketPath);
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    auto server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (server < 0 || ::bind(server, (const sockaddr *) &address, sizeof(address)) < 0 || listen(server, 16) < 0)
+        throw runtime_error("cannot listen on socket " + socketPath);
+    //a client that leaves before its reply must not stop the daemon
+    signal(SIGPIPE, SIG_IGN);
+    log_line() << "[INFO] Serving on " << socketPath << "\n";
+
+    while (true) {
+        auto client = accept(server, nullptr, nullptr);
+        if (client < 0) continue;
+        string pending;
+        char buffer[4096];
+        for (auto count = read(client, buffer, sizeof(buffer)); count > 0; count = read(client, buffer, sizeof(buffer))) {
+            pending.append(buffer, (size_t) count);
+            for (auto end = pending.find('\n'); end != string::npos; end = pending.find('\n')) {
+                auto line = pending.substr(0, end);
+                pending.erase(0, end + 1);
+                if (line.empty()) continue;
+                auto reply = serveJob(line, sunset) + "\n";
+                for (size_t sent = 0; sent < reply.size();) {
+                    auto written = write(client, reply.data() + sent, reply.size() - sent);
+                    if (written <= 0) break;
+                    sent += (size_t) written;
+                }
+            }
+        }
+        close(client);
+    }
+#else
+    throw runtime_error("unix sockets are not available on windows, the daemon reads the jobs from stdin");
+#endif
+}
+
+//Runs the mode chosen by the command line, the errors are thrown to main
+int runMain(int argc, char **argv) {
 
     // parse command line
     auto parser =
@@ -925,19 +3106,163 @@ int main(int argc, char **argv) {
 
     auto outputFile = parse_opt(parser, "--output-image", "-o", "image filename", "scene_out.obj"s);
 
-    auto *scn = new scene();
+    auto render = city_render();
+    render.resolution = parse_opt(parser, "--render-resolution", "-rr",
+                                  "height of the image rendered when the output is an image", 540);
 
-    initScene(scn, sunset);
+    render.samples = parse_opt(parser, "--render-samples", "-rs",
+                               "samples per pixel of the image rendered when the output is an image", 64);
+
+    auto seed = parse_opt(parser, "--seed", "-seed", "seed of the generation, -1 to take it from the time", -1);
+
+    auto tiles = parse_opt(parser, "--tiles", "-tiles", "generate the tiles from (0,0) to (tiles,tiles) of the infinite city, 0 to generate a city of city size", 0);
+
+    auto tileSize = parse_opt(parser, "--tile-size", "-ts", "cells of the side of a tile of the infinite city", 64);
+
+    auto benchmarkFile = parse_opt(parser, "--benchmark", "-bench",
+                                   "run the benchmark and write the json report in this file", ""s);
+
+    auto benchmarkMaxSize = parse_opt(parser, "--benchmark-max-size", "-bms",
+                                      "biggest city size generated by the benchmark", 2000);
+
+    auto batchRoads = parse_flag(parser, "--batch-roads", "-br",
+                                 "merge the road tiles of every part of the city in a few big shapes");
+
+    auto bakeBuildings = parse_flag(parser, "--bake-buildings", "-bb",
+                                    "merge the pieces of every building in one shape for each material");
+
+    auto lodDistance = parse_opt(parser, "--lod-distance", "-lod",
+                                  "buildings farther than this from the camera are boxes, 0 to disable", 0.0f);
+
+    auto roadsFile = parse_opt(parser, "--roads", "-roads", "save the road graph of the city as json in this file", ""s);
+
+    auto roadsArea = parse_opt(parser, "--roads-area", "-roads-area",
+                               "save only the roads with a cell from x0,y0 to x1,y1 (excluded)", ""s);
+
+    auto treeSpacing = parse_opt(parser, "--tree-spacing", "-scatter",
+                                 "scatter the trees with this minimum distance in cells, 0 for up to three in a cell", 0.0f);
+
+    auto traceFile = parse_opt(parser, "--trace", "-trace", "write a Chrome trace of the generation in this file", ""s);
+
+    auto tracePhases = parse_flag(parser, "--trace-phases", "-tp",
+                                  "trace only the phases, without a probe for every building and object");
+
+    auto batchFile = parse_opt(parser, "--batch", "-batch",
+                               "generate the cities of the parameter sweeps in this file, one sweep per line", ""s);
+
+    auto batchThreads = parse_opt(parser, "--batch-threads", "-bt",
+                                  "cities of the batch generated at the same time, 0 for one per core", 0);
 
-    generate(scn, citySize, maxFloors, minFloors, streetSplitChance, buildingCreationChance, treeCreationChance,
-             urbanization);
+    auto serve = parse_flag(parser, "--serve", "-serve",
+                            "run as a daemon that generates the cities of the json jobs read from stdin or the socket");
 
-    cout << "[INFO] Saving scene\n";
+    auto socketPath = parse_opt(parser, "--socket", "-socket", "unix socket where the daemon reads the jobs", ""s);
 
-    save_scene(outputFile, scn, save_options{});
+    auto loadFile = parse_opt(parser, "--load-city", "-load",
+                              "load a city saved in the .city format and save it in the output file", ""s);
 
-    cout << "[INFO] Scne saved\n";
+    auto editRect = parse_opt(parser, "--edit", "-edit",
+                              "x0,y0,x1,y1 cells generated again with the edit parameters after the city", ""s);
 
+    auto editUrbanization = parse_opt(parser, "--edit-urbanization", "-eu",
+                                      "urbanization of the edited cells, -1 to keep the one of the city", -1);
+
+    auto editBuildingChance = parse_opt(parser, "--edit-building-probability", "-ebc",
+                                        "building probability of the edited cells, -1 to keep the one of the city", -1);
+
+    auto editTreeChance = parse_opt(parser, "--edit-tree-probability", "-etc",
+                                    "tree probability of the edited cells, -1 to keep the one of the city", -1);
+
+    if (!traceFile.empty()) {
+        tracer = new city_tracer();
+        tracer->detail = !tracePhases;
+    }
+
+    if (serve) {
+        runServer(socketPath, sunset);
+        if (tracer) save_trace(traceFile);
+        return 0;
+    }
+
+    if (!batchFile.empty()) {
+        runBatch(batchFile, batchThreads, sunset);
+        if (tracer) save_trace(traceFile);
+        return 0;
+    }
+
+    if (!benchmarkFile.empty()) {
+        runBenchmark(benchmarkFile, outputFile, benchmarkMaxSize, seed < 0 ? 1 : (uint64_t) seed);
+        if (tracer) save_trace(traceFile);
+        return 0;
+    }
+
+    if (!loadFile.empty()) {
+        auto loadTimer = timer();
+        auto scn = unique_ptr<scene>(load_city(loadFile));
+        log_line() << "[INFO] City loaded in " << loadTimer.elapsed() << "s\n";
+        if (isImageFile(outputFile)) renderScene(outputFile, scn.get(), render);
+        else {
+            auto noRows = instance_table();
+            saveScene(outputFile, scn.get(), noRows);
+        }
+        if (tracer) save_trace(traceFile);
+        return 0;
+    }
+
+    if (seed < 0) seed = (int) (time(nullptr) & 0x7fffffff);
+    log_line() << "[INFO] Generating city with seed " << seed << "\n";
+
+    auto params = city_params();
+    params.citySize = citySize;
+    params.maxFloors = maxFloors;
+    params.minFloors = minFloors;
+    params.streetSplitChance = streetSplitChance;
+    params.buildingCreationChance = buildingCreationChance;
+    params.treeCreationChance = treeCreationChance;
+    params.urbanization = urbanization;
+    params.seed = (uint64_t) seed;
+    params.batchRoads = batchRoads;
+    params.lodDistance = lodDistance;
+    params.bakeBuildings = bakeBuildings;
+    params.roadsFile = roadsFile;
+    if (!roadsArea.empty()) {
+        auto &area = params.roadsArea;
+        if (sscanf(roadsArea.c_str(), "%d,%d,%d,%d", &area.x, &area.y, &area.z, &area.w) != 4) {
+            log_line() << "[ERROR] The road area must be x0,y0,x1,y1\n";
+            return 1;
+        }
+    }
+    params.treeSpacing = treeSpacing;
+
+    auto edits = vector<city_edit>();
+    if (!editRect.empty()) {
+        auto edit = city_edit();
+        if (sscanf(editRect.c_str(), "%d,%d,%d,%d", &edit.x0, &edit.y0, &edit.x1, &edit.y1) != 4) {
+            log_line() << "[ERROR] The edited cells must be x0,y0,x1,y1\n";
+            return 1;
+        }
+        edit.params = params;
+        if (editUrbanization >= 0) edit.params.urbanization = editUrbanization;
+        if (editBuildingChance >= 0) edit.params.buildingCreationChance = editBuildingChance;
+        if (editTreeChance >= 0) edit.params.treeCreationChance = editTreeChance;
+        edits.push_back(edit);
+    }
+
+    runCity(params, sunset, outputFile, tiles, tileSize, edits, render);
+
+    if (tracer) {
+        save_trace(traceFile);
+        log_line() << "[INFO] Trace saved in " << traceFile << "\n";
+    }
 
     return 0;
 }
+
+int main(int argc, char **argv) {
+    try {
+        return runMain(argc, argv);
+    } catch (const exception &error) {
+        log_line() << "[ERROR] " << error.what() << "\n";
+        return 1;
+    }
+}
@@ -4772,6 +4772,7 @@ glTF* load_gltf(
 // Save buffer data.
 void save_buffers(const glTF* gltf, const string& dirname, bool skip_missing) {
     for (auto buffer : gltf->buffers) {
+        if (buffer->uri == "") continue;
         if (startsiwith(buffer->uri, "data:")) {
             if (skip_missing) continue;
             throw runtime_error("saving of embedded data not supported");